@@ -0,0 +1,32 @@
+#!/bin/sh
+# Measures input throughput on a generated script corpus: assignments and
+# expressions over numbers, identifiers and runs of whitespace, about
+# SIZE megabytes of them (default 64). The time covers the whole batch run
+# (lexing, parsing and evaluation, output to /dev/null), so the figure is
+# a lower bound on the lexer's own throughput.
+#
+#   bench/lexer.sh ./simple_calculator [size-in-MB]
+
+calc=${1:?usage: lexer.sh calculator [size-in-MB]}
+size=${2:-64}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v bytes=$((size * 1048576)) 'BEGIN {
+  srand(1)
+  for (i = 0; i < 64; ++i) printf "var%d = %d;\n", i, i
+  while (total < bytes) {
+    line = sprintf("var%d   =  var%d * %.6f +\t%d - (var%d / 12.5e-1);\n",
+                   int(rand() * 64), int(rand() * 64), rand() * 1000, int(rand() * 100000), int(rand() * 64))
+    printf "%s", line
+    total += length(line)
+  }
+}' > "$dir/corpus.txt"
+
+bytes=$(wc -c < "$dir/corpus.txt")
+start=$(date +%s%N)
+"$calc" "$dir/corpus.txt" > /dev/null
+status=$?
+end=$(date +%s%N)
+awk -v bytes="$bytes" -v ns=$((end - start)) -v status=$status \
+  'BEGIN { printf "%d bytes in %.3f s: %.1f MB/s (%.3f GB/s), exit %d\n", bytes, ns / 1e9, bytes / ns * 1e3, bytes / ns, status }'
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Times the calculator on pathologically nested input: one statement of
+# N nested parentheses and one of N chained unary minus signs, for each
+# depth given (default 1000 10000 100000 1000000).
+#
+#   bench/nesting.sh ./simple_calculator [depth ...]
+
+calc=${1:?usage: nesting.sh calculator [depth ...]}
+shift
+[ $# -gt 0 ] || set -- 1000 10000 100000 1000000
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+run()
+{
+  start=$(date +%s%N)
+  "$calc" "$2" > "$dir/out" 2>&1
+  status=$?
+  end=$(date +%s%N)
+  awk -v kind="$1" -v n="$3" -v ns=$((end - start)) -v status=$status -v out="$(head -c 40 "$dir/out")" \
+    'BEGIN { printf "%-8s %10d %10.3f s  exit %d  %s\n", kind, n, ns / 1e9, status, out }'
+}
+
+for n in "$@"; do
+  awk -v n="$n" 'BEGIN { for (i = 0; i < n; ++i) printf "("; printf "1"; for (i = 0; i < n; ++i) printf ")"; print ";" }' > "$dir/parens.txt"
+  awk -v n="$n" 'BEGIN { for (i = 0; i < n; ++i) printf "-"; print "1;" }' > "$dir/minus.txt"
+  run parens "$dir/parens.txt" "$n"
+  run minus "$dir/minus.txt" "$n"
+done
@@ -0,0 +1,73 @@
+/*
+  calc.h - C interface to the simple calculator
+
+  Build the library from the calculator source:
+
+    c++ -std=c++17 -O2 -shared -fPIC -DCALC_LIBRARY simple_calculator.cpp -o libcalc.so
+
+  A session owns its own variables and constants. An expression is compiled
+  once and then evaluated over whole columns of inputs in a single call. The
+  inputs of an expression are the names it uses that are not defined in the
+  session when it is compiled, in order of first appearance.
+
+  Functions returning int return 0 on success and -1 on error; calc_compile
+  returns NULL on error. calc_last_error() describes the last failed call
+  the calling thread made on that session; other threads' failures do not
+  change it, and it stays valid until the thread's next failure on the
+  session or until the session is freed. No C++ exception crosses this
+  interface. The calculator itself is single-threaded:
+  sessions share its global state, so every call that uses a session holds
+  one library-wide lock, and calls from different threads run one at a time.
+
+  Calls waiting for the calculator queue per session, and each session's
+  calls run in arrival order. Between sessions with waiting calls, a session
+  of weight w (calc_set_weight, default 1) is admitted w times as often as a
+  session of weight 1. A call that finds queue_limit calls of its session
+  already waiting (calc_set_queue_limit, default 64) fails at once with a
+  "queue full" error. calc_get_queue_stats reports how long admitted calls
+  waited; the 'stats' statement shows the totals over all sessions.
+*/
+
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct calc_session calc_session;
+typedef struct calc_expr calc_expr;
+
+calc_session* calc_session_new(void);
+void calc_session_free(calc_session* session);
+const char* calc_last_error(const calc_session* session);
+
+typedef struct calc_queue_stats {
+  unsigned long long admitted;    /* calls that ran */
+  unsigned long long rejected;    /* calls refused because the queue was full */
+  double wait_seconds;            /* total time admitted calls spent queued */
+  double max_wait_seconds;
+  size_t waiting;                 /* calls queued right now */
+} calc_queue_stats;
+
+int calc_set_weight(calc_session* session, unsigned weight);
+int calc_set_queue_limit(calc_session* session, size_t limit);
+void calc_get_queue_stats(const calc_session* session, calc_queue_stats* stats);
+
+int calc_set(calc_session* session, const char* name, double value);
+int calc_run(calc_session* session, const char* statement, double* result);
+
+calc_expr* calc_compile(calc_session* session, const char* expression);
+void calc_expr_free(calc_expr* expr);
+size_t calc_expr_inputs(const calc_expr* expr);
+const char* calc_expr_input_name(const calc_expr* expr, size_t i);
+
+int calc_eval_batch(calc_expr* expr, size_t n, const double** input_columns, double* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
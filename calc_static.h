@@ -0,0 +1,334 @@
+/*
+  calc_static.h - compile-time front end for the simple calculator
+
+  Parses a calculator expression while the C++ program is being compiled,
+  using the same grammar and builtin functions as simple_calculator.cpp,
+  and turns it into straight-line code with no parsing or instruction
+  dispatch left at runtime. Requires C++20.
+
+    #include "calc_static.h"
+
+    constexpr auto f = calc::compile<"a*sin(b) + c">();
+    double y = f(a, b, c);       // arguments in order of first appearance
+
+  A malformed expression is a compile error. Names are the formula's inputs;
+  there is no environment, so constants must be written as literals. Division
+  or modulo by zero throws std::runtime_error("divide by zero"), like the
+  interpreter. Literals with more than 15 significant digits or a large
+  exponent may differ from strtod in the last bit.
+*/
+
+#ifndef CALC_STATIC_H
+#define CALC_STATIC_H
+
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace calc {
+
+template<std::size_t N>
+struct fixed_string
+{
+  char text[N];
+
+  constexpr fixed_string(const char (&s)[N])
+  {
+    for (std::size_t i = 0; i < N; ++i) text[i] = s[i];
+  }
+
+  constexpr std::size_t size() const { return N - 1; }
+};
+
+enum class op : unsigned char
+{
+  literal,
+  input,
+  negate,
+  add,
+  subtract,
+  multiply,
+  divide,
+  modulo,
+  call,
+  power
+};
+
+enum class builtin : unsigned char
+{
+  sin, cos, tan, asin, acos, atan, exp, ln, log10, log2, pow, none
+};
+
+struct instruction
+{
+  op kind = op::literal;
+  double value = 0;
+  std::size_t index = 0;
+  builtin function = builtin::none;
+};
+
+template<std::size_t Capacity>
+struct program
+{
+  instruction code[Capacity] = {};
+  std::size_t depth[Capacity] = {};      // stack size after each instruction
+  std::size_t size = 0;
+  std::size_t max_depth = 0;
+  std::size_t name_start[Capacity] = {};
+  std::size_t name_length[Capacity] = {};
+  std::size_t inputs = 0;
+};
+
+namespace detail {
+
+constexpr bool is_space(char c) { return c==' ' || c=='\t' || c=='\n' || c=='\r'; }
+constexpr bool is_digit(char c) { return c>='0' && c<='9'; }
+constexpr bool is_alpha(char c) { return (c>='a' && c<='z') || (c>='A' && c<='Z'); }
+
+constexpr builtin find_builtin(std::string_view s)
+{
+  if (s=="sin") return builtin::sin;
+  if (s=="cos") return builtin::cos;
+  if (s=="tan") return builtin::tan;
+  if (s=="asin") return builtin::asin;
+  if (s=="acos") return builtin::acos;
+  if (s=="atan") return builtin::atan;
+  if (s=="exp") return builtin::exp;
+  if (s=="pow") return builtin::pow;
+  if (s=="ln") return builtin::ln;
+  if (s=="log10") return builtin::log10;
+  if (s=="log2") return builtin::log2;
+  return builtin::none;
+}
+
+template<std::size_t Capacity>
+class parser
+{
+  private:
+    std::string_view text;
+    std::size_t pos = 0;
+    program<Capacity> result;
+    std::size_t depth = 0;
+
+    constexpr void emit(instruction in)
+    {
+      if (in.kind==op::literal || in.kind==op::input) ++depth;
+      else if (in.kind!=op::negate && in.kind!=op::call) --depth;
+      result.code[result.size] = in;
+      result.depth[result.size] = depth;
+      ++result.size;
+      if (depth > result.max_depth) result.max_depth = depth;
+    }
+
+    constexpr char peek()
+    {
+      while (pos < text.size() && is_space(text[pos])) ++pos;
+      return pos < text.size() ? text[pos] : 0;
+    }
+
+    constexpr void expect(char c, const char* message)
+    {
+      if (peek() != c) throw std::logic_error(message);
+      ++pos;
+    }
+
+    constexpr double number()
+    {
+      unsigned long long mantissa = 0;
+      int digits = 0;
+      int exponent = 0;
+      bool any = false;
+      for (; pos < text.size() && is_digit(text[pos]); ++pos, any = true)
+        if (digits < 19) { mantissa = mantissa*10 + (text[pos]-'0'); if (mantissa) ++digits; }
+        else ++exponent;
+      if (pos < text.size() && text[pos]=='.')
+        for (++pos; pos < text.size() && is_digit(text[pos]); ++pos, any = true)
+          if (digits < 19) { mantissa = mantissa*10 + (text[pos]-'0'); if (mantissa) ++digits; --exponent; }
+      if (!any) throw std::logic_error("Bad token");
+      if (pos < text.size() && (text[pos]=='e' || text[pos]=='E')) {
+        std::size_t mark = pos++;
+        int sign = 1;
+        if (pos < text.size() && (text[pos]=='+' || text[pos]=='-')) sign = (text[pos++]=='-') ? -1 : 1;
+        if (pos < text.size() && is_digit(text[pos])) {
+          int e = 0;
+          for (; pos < text.size() && is_digit(text[pos]); ++pos) e = e*10 + (text[pos]-'0');
+          exponent += sign*e;
+        }
+        else pos = mark;
+      }
+
+      double value = static_cast<double>(mantissa);
+      double scale = 1;
+      for (int i = 0; i < (exponent < 0 ? -exponent : exponent); ++i) scale *= 10;
+      return exponent < 0 ? value/scale : value*scale;
+    }
+
+    constexpr std::size_t input(std::size_t start, std::size_t length)
+    {
+      for (std::size_t i = 0; i < result.inputs; ++i)
+        if (text.substr(result.name_start[i], result.name_length[i]) == text.substr(start, length)) return i;
+      result.name_start[result.inputs] = start;
+      result.name_length[result.inputs] = length;
+      return result.inputs++;
+    }
+
+    constexpr void primary()
+    {
+      char c = peek();
+      if (c=='(') {
+        ++pos;
+        expression();
+        expect(')', "'(' expected");
+      }
+      else if (c=='-') { ++pos; primary(); emit({op::negate}); }
+      else if (c=='+') { ++pos; primary(); }
+      else if (c=='.' || is_digit(c)) emit({op::literal, number()});
+      else if (is_alpha(c)) {
+        std::size_t start = pos;
+        while (pos < text.size() && (is_alpha(text[pos]) || is_digit(text[pos]))) ++pos;
+        std::string_view s = text.substr(start, pos - start);
+        builtin f = find_builtin(s);
+        if (f==builtin::none) { emit({op::input, 0, input(start, pos - start)}); return; }
+
+        expect('(', "'(' expected");
+        expression();
+        if (peek()==',') {
+          ++pos;
+          if (f!=builtin::pow) throw std::logic_error("function needs only one argument");
+          expression();
+          expect(')', "')' expected");
+          emit({op::power});
+        }
+        else {
+          expect(')', "')' expected");
+          if (f==builtin::pow) throw std::logic_error("pow needs two arguments");
+          emit({op::call, 0, 0, f});
+        }
+      }
+      else throw std::logic_error("primary expected");
+    }
+
+    constexpr void term()
+    {
+      primary();
+      while (true) {
+        char c = peek();
+        if (c=='*') { ++pos; primary(); emit({op::multiply}); }
+        else if (c=='/') { ++pos; primary(); emit({op::divide}); }
+        else if (c=='%') { ++pos; primary(); emit({op::modulo}); }
+        else return;
+      }
+    }
+
+    constexpr void expression()
+    {
+      term();
+      while (true) {
+        char c = peek();
+        if (c=='+') { ++pos; term(); emit({op::add}); }
+        else if (c=='-') { ++pos; term(); emit({op::subtract}); }
+        else return;
+      }
+    }
+
+  public:
+    constexpr parser(std::string_view s) : text(s) {}
+
+    constexpr program<Capacity> parse()
+    {
+      expression();
+      if (peek()==';') ++pos;
+      if (peek()!=0) throw std::logic_error("unexpected text after expression");
+      return result;
+    }
+};
+
+inline double apply(builtin f, double x)
+{
+  switch (f)
+  {
+    case builtin::sin: return std::sin(x);
+    case builtin::cos: return std::cos(x);
+    case builtin::tan: return std::tan(x);
+    case builtin::asin: return std::asin(x);
+    case builtin::acos: return std::acos(x);
+    case builtin::atan: return std::atan(x);
+    case builtin::exp: return std::exp(x);
+    case builtin::ln: return std::log(x);
+    case builtin::log10: return std::log10(x);
+    case builtin::log2: return std::log2(x);
+    default: return x;
+  }
+}
+
+}
+
+template<fixed_string Source>
+class formula
+{
+  private:
+    static constexpr auto code = detail::parser<Source.size() + 1>(Source.text).parse();
+
+    template<std::size_t I>
+    static constexpr void step(double* stack, const double* in)
+    {
+      constexpr instruction op_ = code.code[I];
+      constexpr std::size_t top = code.depth[I] - 1;
+
+      if constexpr (op_.kind==op::literal) stack[top] = op_.value;
+      else if constexpr (op_.kind==op::input) stack[top] = in[op_.index];
+      else if constexpr (op_.kind==op::negate) stack[top] = -stack[top];
+      else if constexpr (op_.kind==op::call) stack[top] = detail::apply(op_.function, stack[top]);
+      else if constexpr (op_.kind==op::add) stack[top] += stack[top+1];
+      else if constexpr (op_.kind==op::subtract) stack[top] -= stack[top+1];
+      else if constexpr (op_.kind==op::multiply) stack[top] *= stack[top+1];
+      else if constexpr (op_.kind==op::divide) {
+        if (stack[top+1] == 0) throw std::runtime_error("divide by zero");
+        stack[top] /= stack[top+1];
+      }
+      else if constexpr (op_.kind==op::modulo) {
+        if (stack[top+1] == 0) throw std::runtime_error("divide by zero");
+        stack[top] = std::fmod(stack[top], stack[top+1]);
+      }
+      else if constexpr (op_.kind==op::power) stack[top] = std::pow(stack[top], stack[top+1]);
+    }
+
+    template<std::size_t... I>
+    static constexpr double run(const double* in, std::index_sequence<I...>)
+    {
+      double stack[code.max_depth] = {};
+      (step<I>(stack, in), ...);
+      return stack[0];
+    }
+
+  public:
+    static constexpr std::size_t inputs = code.inputs;
+    static constexpr std::size_t instructions = code.size;
+
+    static constexpr std::string_view input_name(std::size_t i)
+    {
+      return std::string_view(Source.text).substr(code.name_start[i], code.name_length[i]);
+    }
+
+    template<class... Args>
+    constexpr double operator()(Args... args) const
+    {
+      static_assert(sizeof...(Args) == inputs, "wrong number of arguments for formula");
+      const double in[inputs + 1] = {static_cast<double>(args)...};
+      return run(in, std::make_index_sequence<code.size>());
+    }
+};
+
+template<fixed_string Source>
+constexpr formula<Source> compile() { return {}; }
+
+}
+
+// Parsing and evaluation of pure arithmetic happen entirely at compile time.
+static_assert(calc::compile<"(1+2)*3 - -4/2">()() == 11.0);
+static_assert(calc::compile<"a*sin(b) + c">().inputs == 3);
+static_assert(calc::compile<"a*sin(b) + c">().input_name(1) == "b");
+
+#endif
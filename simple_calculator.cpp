@@ -7,6 +7,36 @@
     - Environment saving/loading
     - Customizable output precision
     - Commands for inspecting environment
+    - Batch mode: 'simple_calculator script.txt' runs a script without prompts
+    - Optimized batch mode: 'simple_calculator -O script.txt' folds constants
+      across statements and drops assignments overwritten before being read;
+      only expression results are printed, the final environment is unchanged
+    - Compiled scripts: 'simple_calculator -c script.txt' writes script.calcc;
+      batch runs reuse it while its hash still matches the script text
+    - Session images: 'simple_calculator -i session.img [script.txt]' starts
+      from an image written by 'save image'
+    - Recording: 'simple_calculator -r session.log' appends every line read
+      from standard input to a binary log, stamped with the time and a
+      session id; '-p session.log [id]' replays one session at the original
+      pace and '-P session.log [id]' as fast as possible, then reports the
+      elapsed time. The id may be left out when the log holds one session;
+      otherwise the replay lists the sessions it holds
+    - Pinned workers: 'simple_calculator -T ...' pins each worker thread
+      spawned for parsing, formatting, aggregates and fitting to one core;
+      the thread that starts the work is left unpinned
+    - Native formulas: 'simple_calculator -N ...' builds the formulas given
+      to 'eval ... over' with the system C++ compiler (CXX, default c++) at
+      -O3 -march=native into a shared object, and loads it with dlopen; the
+      interpreter runs them whenever that fails. Objects are cached in
+      $XDG_CACHE_HOME/calc-native (or ~/.cache/calc-native), which must be
+      private to the user. On older glibc, link with -ldl.
+    - Worker processes: 'simple_calculator -W n ...' computes aggregates
+      such as 'eval sum(...) over' in n forked processes; each parses its
+      own byte range of the file and sends its partial result back over a
+      socket
+    - C interface: building with -DCALC_LIBRARY leaves out main() and exports
+      the functions declared in calc.h
+    - Compile-time formulas for C++20 code: see calc_static.h
 
   Grammar:
 
@@ -19,9 +49,20 @@
     Quit
     Precision
     Set Precision
+    Set Tier
+    Stats
+    Explain
+    Eval
+    Fit
+    Adjoint
     Show Env
     Save Env
     Load Env
+    Watch Env
+    Save Image
+    Load Image
+    Load Table
+    Cpp
 
   Print:
     ;
@@ -44,6 +85,36 @@
   Set Precision:
     set precision Number
 
+  Set Tier:
+    set tier Number
+
+  Stats:
+    stats
+
+  Explain:
+    explain Statement
+    explain analyze Number Statement
+
+  Eval:
+    eval Expression over CsvName
+    eval Aggregate ( Expression ) over CsvName
+
+  Aggregate:
+    sum
+    mean
+    min
+    max
+
+  Fit:
+    fit Expression to Name varying Parameters over CsvName
+
+  Parameters:
+    Name
+    Name , Parameters
+
+  Adjoint:
+    adjoint Expression
+
   Show Env:
     show env
 
@@ -53,6 +124,22 @@
   Load Env:
     load env FileName
 
+  Watch Env:
+    watch env FileName
+
+  Save Image:
+    save image ImageName
+
+  Load Image:
+    load image ImageName
+
+  Load Table:
+    load table Name CsvName
+
+  Cpp:
+    cpp Expression
+    cpp Name = Expression
+
   Expression:
     Term
     Term + Expression
@@ -72,9 +159,13 @@
     - Primary
     + Primary
 
+  Expressions are parsed with an explicit operator stack rather than by
+  recursion, so nesting depth is limited only by memory.
+
   Function:
     FunctionName ( Expression )
     FunctionName ( Expression , Expression )
+    TableFunction ( Name , Expression )
 
   FunctionName:
     sin
@@ -89,6 +180,11 @@
     log10
     log2
 
+  TableFunction:
+    lookup
+    interp
+    spline
+
   Number:
     floating-point-literal
 
@@ -97,16 +193,58 @@
 
   FileName:
     a valid filename (e.g., env.txt, my_env-1.dat)
+
+  ImageName:
+    a filename ending in .img (e.g., session.img)
+
+  CsvName:
+    a comma-separated file ending in .csv whose first line names the columns;
+    for load table, the first column holds the keys and the second the values
 */
 
 #include <iostream>
 #include <string>
 #include <stdexcept>
-#include <queue>
+#include <deque>
 #include <cmath>
 #include <sstream>
 #include <map>
 #include <fstream>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <random>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dlfcn.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include "calc.h"
 
 using namespace std;
 
@@ -137,9 +275,17 @@ struct Token
     function_token,
     precision_token,
     set_precision_token,
+    set_tier_token,
+    stats_token,
+    explain_token,
+    eval_token,
+    adjoint_token,
+    fit_token,
     show_env_token,
     save_env_token,
-    load_env_token
+    load_env_token,
+    watch_env_token,
+    cpp_token
   };
 
   id kind;
@@ -179,16 +325,40 @@ struct Token
   bool is_function() { return (kind==id::function_token); }
 };
 
+const map<string,Token::function_t*> functions = {
+  {"sin",sin},
+  {"cos",cos},
+  {"tan",tan},
+  {"asin",asin},
+  {"acos",acos},
+  {"atan",atan},
+  {"exp",exp},
+  {"pow",nullptr},
+  {"ln",log},
+  {"log10",log10},
+  {"log2",log2},
+  {"lookup",nullptr},
+  {"interp",nullptr},
+  {"spline",nullptr}
+};
+
 class Token_stream 
 { 
   private:
 
-    queue<Token> buffer; 
+    deque<Token> buffer; 
+    Token::id last;
+    streambuf* source;   // null: read from cin
+    Token read();
   public: 
-    Token_stream() { } 
+    Token_stream() : last(Token::id::none), source(nullptr) { } 
     Token get(); 
-    void unget(Token t) { buffer.push(t); } 
+    void attach(streambuf* s) { source = s; }
+    streambuf* input() const { return source ? source : cin.rdbuf(); }
+    void unget(Token t) { buffer.push_front(t); } 
     void ignore();
+    void reset() { buffer.clear(); last = Token::id::none; }
+    size_t pending() const { return buffer.size(); }
 };
 
 Token Token_stream::get()
@@ -196,12 +366,99 @@ Token Token_stream::get()
   if(!buffer.empty()) 
   { 
     auto t=buffer.front(); 
-    buffer.pop(); 
+    buffer.pop_front(); 
+    last=t.kind;
     return t; 
   }
 
-  char ch;
-  do { cin.get(ch); } while(isspace(ch));
+  last=Token::id::none;
+  Token t=read();
+  last=t.kind;
+  return t;
+}
+
+const unsigned char space_char = 1;
+const unsigned char digit_char = 2;
+const unsigned char alpha_char = 4;
+
+struct Char_table
+{
+  unsigned char kind[256];
+
+  Char_table()
+  {
+    for (int c = 0; c < 256; ++c)
+      kind[c] = (isspace(c) ? space_char : 0) | (isdigit(c) ? digit_char : 0) | (isalpha(c) ? alpha_char : 0);
+  }
+};
+
+const Char_table char_table;
+
+const map<string,Token::id> keywords = {
+  {"quit",Token::id::quit},
+  {"const",Token::id::const_token},
+  {"help",Token::id::help_token},
+  {"precision",Token::id::precision_token},
+  {"show",Token::id::show_env_token},
+  {"save",Token::id::save_env_token},
+  {"load",Token::id::load_env_token},
+  {"watch",Token::id::watch_env_token},
+  {"cpp",Token::id::cpp_token},
+  {"stats",Token::id::stats_token},
+  {"explain",Token::id::explain_token},
+  {"eval",Token::id::eval_token},
+  {"adjoint",Token::id::adjoint_token},
+  {"fit",Token::id::fit_token}
+};
+
+bool is_digit_at(int c) { return c!=EOF && (char_table.kind[c] & digit_char); }
+
+double read_number(streambuf* in, char first)
+{
+  string s(1,first);
+  bool dot = (first=='.');
+  int c;
+  while ((c=in->sgetc())!=EOF) {
+    if (is_digit_at(c)) s+=char(c);
+    else if (c=='.' && !dot) { dot=true; s+='.'; }
+    else break;
+    in->sbumpc();
+  }
+
+  if (c=='e' || c=='E') {
+    in->sbumpc();
+    int next=in->sgetc();
+    if (next=='+' || next=='-' || is_digit_at(next)) {
+      s+='e';
+      if (!is_digit_at(next)) {
+        s+=char(next);
+        in->sbumpc();
+        if (!is_digit_at(in->sgetc())) error("Bad number");
+      }
+      while (is_digit_at(c=in->sgetc())) { s+=char(c); in->sbumpc(); }
+    }
+    else in->sputbackc(char(c));
+  }
+
+  char* end;
+  double val=strtod(s.c_str(),&end);
+  if (*end) error("Bad token");
+  return val;
+}
+
+Token Token_stream::read()
+{
+  if (!source && cin.tie()) cin.tie()->flush();
+  streambuf* in=input();
+
+  int c=in->sbumpc();
+  while (c!=EOF && (char_table.kind[c] & space_char)) c=in->sbumpc();
+  if (c==EOF) {
+    if (!source) cin.setstate(ios::eofbit);
+    return Token(Token::id::quit);
+  }
+
+  char ch=c;
   switch (ch) 
   {
     case '(':
@@ -229,85 +486,75 @@ Token Token_stream::get()
     case '7':
     case '8':
     case '9':
-    {	
-      cin.unget();
-      double val;
-      cin>>val;
-      return Token(val);
-    }
+      return Token(read_number(in,ch));
+
     default:
-    	if (isalpha(ch)) 
+    	if (char_table.kind[c] & alpha_char) 
       {
-        string s;
-        s+=ch;
-        while(cin.get(ch) && (isalpha(ch) || isdigit(ch))) s+=ch;
-        cin.unget();
-
-        if(s=="quit") return Token(Token::id::quit);
-        if(s=="const") return Token(Token::id::const_token);
-        if(s=="help") return Token(Token::id::help_token);
-        if(s=="precision") return Token(Token::id::precision_token);
+        string s(1,ch);
+        while ((c=in->sgetc())!=EOF && (char_table.kind[c] & (alpha_char|digit_char))) {
+          s+=char(c);
+          in->sbumpc();
+        }
+
         if(s=="set") {
           string next;
-          cin >> next;
+          while ((c=in->sgetc())!=EOF && (char_table.kind[c] & space_char)) in->sbumpc();
+          while ((c=in->sgetc())!=EOF && !(char_table.kind[c] & space_char)) { next+=char(c); in->sbumpc(); }
           if(next == "precision") return Token(Token::id::set_precision_token);
-          error("Expected 'precision' after 'set'");
-        }
-        if (s == "show")return Token(Token::id::show_env_token);
-        if (s == "save"){
-          return Token(Token::id::save_env_token);
-        }
-        if (s == "load"){
-          return Token(Token::id::load_env_token);
+          if(next == "tier") return Token(Token::id::set_tier_token);
+          error("Expected 'precision' or 'tier' after 'set'");
         }
 
-        if(s=="sin") return Token(s,sin);
-        if(s=="cos") return Token(s,cos);
-        if(s=="tan") return Token(s,tan);
-        if(s=="asin") return Token(s,asin);
-        if(s=="acos") return Token(s,acos);
-        if(s=="atan") return Token(s,atan);
-        if(s=="exp") return Token(s,exp);
-        if(s=="pow") return Token(s,nullptr);
-        if(s=="ln") return Token(s,log);
-        if(s=="log10") return Token(s,log10);
-        if(s=="log2") return Token(s,log2);
+        auto k=keywords.find(s);
+        if(k!=keywords.end()) return Token(k->second);
+
+        auto f=functions.find(s);
+        if(f!=functions.end()) return Token(s,f->second);
 
         return Token(s);
     	}
     	error("Bad token");
   }
+  return Token();
 }
 
 void Token_stream::ignore()
 {
   while(!buffer.empty())
   {
-    auto t=buffer.front(); buffer.pop();
-    if(t.kind==Token::id::quit) return;
+    auto t=buffer.front(); buffer.pop_front();
+    if(t.kind==Token::id::print) return;
   }
+  if(last==Token::id::print) return;
 
-  char ch;
-  while (cin>>ch)
-    if (ch==';') return;
+  for (int c; (c=input()->sbumpc())!=EOF;)
+    if (c==';') return;
+  if (!source) cin.setstate(ios::eofbit);
 }
 
+unsigned long version_clock = 0;
+
 struct Value 
 {
   string name;
   double value;
   bool is_const;
+  unsigned long version;
 
-  Value() :name{}, value{0}, is_const{false} {}
+  Value() :name{}, value{0}, is_const{false}, version{++version_clock} {}
 
   Value(string n, double v, bool is_constant=false) 
-    :name(n), value(v), is_const(is_constant) 
+    :name(n), value(v), is_const(is_constant), version(++version_clock) 
   {}
 };
 
 map<string,Value> names;
 int current_precision = 6;
 
+const string prompt = "> ";
+const string result = "= ";
+
 double get_value(string s)
 {
   if(names.count(s)>0) return names[s].value;
@@ -320,6 +567,8 @@ void set_value(string s, double d)
   {
     if(names[s].is_const) error("set: const name ",s);
     names[s].value=d;
+    names[s].version=++version_clock;
+    return;
   }
   error("set: undefined name ",s);
 }
@@ -337,339 +586,2745 @@ bool is_declared(string s) { return (names.count(s)>0); }
 void define_name(string s, double d, bool constant=false)
 { names[s]=Value(s,d,constant); }
 
-Token_stream ts;
-
-double expression();
+unsigned long env_generation = 0;
 
-double function_name()
+void redefine_name(string s, double d, bool constant)
 {
-  Token t=ts.get();
-  if(!t.is_function()) error("function name expected");
-  Token tt=ts.get();
-  if(!tt.is_symbol('(')) error("'(' expected");
-  double d=expression();
-  tt=ts.get();
-  if(tt.is_symbol(')')) 
-  {
-    if(t.function) return t.function(d);
-    else error(t.name," needs two arguments");
-  }
-  else if(!tt.is_symbol(',')) error("')' expected");
-  {
-    double dd=expression();
-    tt=ts.get();
-    if(tt.is_symbol(')')) 
-    {
-      if(t.name=="pow") return pow(d,dd); 
-      else error(t.name," needs only one argument");
-    }
-    else error("')' expected");
-  }
+  names[s]=Value(s,d,constant);
+  ++env_generation;
 }
 
-double primary()
+struct Table
 {
-  Token t = ts.get();
-  if(t.is_function()) { ts.unget(t); return function_name(); }
-  else if(t.kind==Token::id::char_token)
-  {
-    if(t.is_symbol('('))
-    {
-      double d=expression();
-      t=ts.get();
-      if(!t.is_symbol(')')) error("'(' expected");
-      return d;
-    }
-    else if(t.is_symbol('-')) return -primary();
-    else if(t.is_symbol('+')) return primary();
-  }
-  else if(t.kind==Token::id::number) return t.value;
-  else if(t.kind==Token::id::name_token) return get_value(t.name);
-  error("primary expected");
+  vector<double> keys;
+  vector<double> values;
+  vector<size_t> direct;    // key - keys[0] -> position, up to 2n+64 slots for integer keys
+  vector<double> curvature; // second derivatives of the natural cubic spline through the points
+};
+
+map<string,Table> tables;
+const size_t no_entry = size_t(-1);
+
+const Table& get_table(const string& s)
+{
+  auto p = tables.find(s);
+  if (p == tables.end()) error("lookup: undefined table ",s);
+  return p->second;
 }
 
-double term()
+size_t floor_index(const vector<double>& keys, double key)
 {
-  double left = primary();
-  while(true) 
-  {
-    Token t = ts.get();
-    if(t.is_symbol('*')) left *= primary();
-    else if(t.is_symbol('/')) 
-    {	
-      double d = primary();
-      if (d == 0) error("divide by zero");
-      left /= d;
-    }
-    else if(t.is_symbol('%'))
-    {	
-      double d = primary();
-      if (d == 0) error("divide by zero");
-      left=fmod(left,d);
-    }
-    else { ts.unget(t); return left; }
+  const double* base = keys.data();
+  size_t n = keys.size();
+  while (n > 1) {
+    size_t half = n / 2;
+    base = (base[half] <= key) ? base + half : base;
+    n -= half;
   }
+  return base - keys.data();
 }
 
-double expression()
+inline double lookup(const Table& t, double key)
 {
-  double left = term();
-  while(true) 
-  {
-    Token t = ts.get();
-    if(t.is_symbol('+')) left+=term();
-    else if(t.is_symbol('-')) left-=term();
-    else { ts.unget(t); return left; }
+  size_t i;
+  if (!t.direct.empty()) {
+    double offset = key - t.keys[0];
+    i = (offset >= 0 && offset < t.direct.size() && offset == floor(offset)) ? t.direct[size_t(offset)] : no_entry;
+  }
+  else {
+    i = floor_index(t.keys, key);
+    if (t.keys[i] != key) i = no_entry;
   }
+  if (i == no_entry) { ostringstream ostr; ostr << key; error("lookup: no entry for key ",ostr.str()); }
+  return t.values[i];
 }
 
-double assign()
+inline double interpolate(const Table& t, double x)
 {
-  Token t=ts.get();
-  if(t.kind!=Token::id::name_token) error ("name expected in assign");
-  string name = t.name;
-  if (is_constant(name)) error(name," constant cannot be modified"); 
-  t=ts.get();
-  if(!t.is_symbol('=')) error("= missing in assign of " ,name);
-  double d = expression();
-  if(is_declared(name)) 
-    set_value(name,d);
-  else
-    define_name(name,d);
-  return d;
+  if (!(x > t.keys[0])) return t.values[0];
+  size_t i = floor_index(t.keys, x);
+  if (i + 1 == t.keys.size()) return t.values[i];
+  double f = (x - t.keys[i]) / (t.keys[i+1] - t.keys[i]);
+  return t.values[i] + f * (t.values[i+1] - t.values[i]);
 }
 
-double constant_assign()
+inline double spline(const Table& t, double x)
 {
-  Token t=ts.get();
-  if(t.kind!=Token::id::name_token) error("name expected in const assign");
-  string name = t.name;
-  if(is_declared(name)) error(name," has already been defined"); 
-  t=ts.get();
-  if(!t.is_symbol('=')) error("= missing in assign of " ,name);
-  double d = expression();
-  define_name(name,d,true);
-  return d;
+  if (!(x > t.keys[0])) return t.values[0];
+  size_t i = floor_index(t.keys, x);
+  if (i + 1 == t.keys.size()) return t.values[i];
+  double h = t.keys[i+1] - t.keys[i];
+  double b = (x - t.keys[i]) / h;
+  double a = 1 - b;
+  return a * t.values[i] + b * t.values[i+1]
+    + ((a*a*a - a) * t.curvature[i] + (b*b*b - b) * t.curvature[i+1]) * h * h / 6;
 }
 
-void set_precision()
+struct Instruction
 {
-  Token t = ts.get();
-  if (t.kind != Token::id::number)
-    error("Expected a number after 'set precision'");
-  int digits = static_cast<int>(t.value);
-  if (digits < 0 || digits > 20)
-    error("Precision must be between 0 and 20");
-  current_precision = digits;
-  cout << "Precision set to " << digits << " digits." << endl;
-}
+  enum id
+  {
+    literal,
+    load,
+    load_slot,
+    load_column,
+    negate,
+    add,
+    subtract,
+    multiply,
+    divide,
+    modulo,
+    call,
+    power,
+    lookup,
+    interp,
+    spline
+  };
 
-void show_precision()
+  id kind;
+  double value;
+  string name;
+  Token::function_t* function;
+  const Value* slot;
+  const Table* table;
+  size_t column;
+
+  Instruction(id op)
+  : kind(op), value(0), name(), function(nullptr), slot(nullptr), table(nullptr), column(0)
+  {}
+
+  Instruction(double val)
+  : kind(id::literal), value(val), name(), function(nullptr), slot(nullptr), table(nullptr), column(0)
+  {}
+
+  Instruction(id op, const string& str, Token::function_t* the_function=nullptr)
+  : kind(op), value(0), name(str), function(the_function), slot(nullptr), table(nullptr), column(0)
+  {}
+};
+
+using Code = vector<Instruction>;
+
+const map<string,Instruction::id> table_functions = {
+  {"lookup",Instruction::id::lookup},
+  {"interp",Instruction::id::interp},
+  {"spline",Instruction::id::spline}
+};
+
+inline bool uses_table(const Instruction& in) { return in.kind>=Instruction::id::lookup; }
+
+double apply_table(const Instruction& in, double x)
 {
-  cout << "Current precision: " << current_precision << " digits." << endl;
+  const Table& t = in.table ? *in.table : get_table(in.name);
+  switch (in.kind)
+  {
+    case Instruction::id::lookup: return lookup(t, x);
+    case Instruction::id::interp: return interpolate(t, x);
+    default: return spline(t, x);
+  }
 }
 
-void set_precision(int digits)
+struct Statement
 {
-  if (digits < 0 || digits > 20)
-    error("Precision must be between 0 and 20");
-  current_precision = digits;
-  cout.setf(ios::fixed);
-  cout.precision(current_precision);
-}
+  enum id
+  {
+    expression,
+    assignment,
+    constant
+  };
 
-void show_env()
+  id kind;
+  string name;
+  Code code;
+
+  Statement(id k, const string& n, const Code& c)
+  : kind(k), name(n), code(c)
+  {}
+};
+
+Token_stream ts;
+
+struct Pending
 {
-  if (names.empty()) {
-    error("\nshow env: (none)\n");
-  }
+  enum id
+  {
+    binary,
+    negate,
+    paren,
+    call
+  };
 
-  cout << "\nCurrent environment:" << endl << endl;
-  for (const auto& [key, val] : names) {
-    cout << "  " << key << " = " << val.value;
-    if (val.is_const) cout << " (const)";
-    cout << endl << endl;
+  id kind;
+  Instruction::id op;
+  int precedence;
+  Token function;
+  int args;
+  string table;
+
+  Pending(id k)
+  : kind(k), op(Instruction::id::add), precedence(0), function(), args(0), table()
+  {}
+
+  Pending(Instruction::id o, int p)
+  : kind(id::binary), op(o), precedence(p), function(), args(0), table()
+  {}
+
+  Pending(const Token& f)
+  : kind(id::call), op(Instruction::id::call), precedence(0), function(f), args(1), table()
+  {}
+};
+
+void reduce(Code& code, vector<Pending>& pending, int precedence)
+{
+  while (!pending.empty() && pending.back().kind==Pending::id::binary && pending.back().precedence>=precedence) {
+    code.push_back(Instruction(pending.back().op));
+    pending.pop_back();
   }
 }
 
-void save_env(string filename)
+void operand_done(Code& code, vector<Pending>& pending)
 {
-  if (names.empty()) {
-    error("\nsave env: No variables or constants to save.\n");
+  while (!pending.empty() && pending.back().kind==Pending::id::negate) {
+    code.push_back(Instruction(Instruction::id::negate));
+    pending.pop_back();
   }
+}
 
-  cout 
-    << "\n Enter precision for saving:"
-    << "\n"
-    << "\n1. Default (6 digits)"
-    << "\n2. Medium (12 digits)"
-    << "\n3. High (19 digits)";
-  cout << "\n\nSelect option (1-3): ";
-
-  int option;
-  int save_precision;
-  bool loop = true;
+void finish_call(Code& code, const Pending& frame)
+{
+  const Token& t = frame.function;
+  if (frame.args==1) {
+    if (t.function) code.push_back(Instruction(Instruction::id::call,t.name,t.function));
+    else error(t.name," needs two arguments");
+  }
+  else {
+    if (t.name=="pow") code.push_back(Instruction(Instruction::id::power));
+    else if (table_functions.count(t.name)) code.push_back(Instruction(table_functions.at(t.name),frame.table));
+    else error(t.name," needs only one argument");
+  }
+}
 
-  while (loop){
-    cin.clear();
-    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+void expression(Code& code)
+{
+  vector<Pending> pending;
+  bool operand = true;
+  while (true)
+  {
+    Token t = ts.get();
+    if (operand)
+    {
+      if (t.is_function()) {
+        Token tt = ts.get();
+        if (!tt.is_symbol('(')) error("'(' expected");
+        pending.push_back(Pending(t));
+        if (table_functions.count(t.name)) {
+          Token table = ts.get();
+          if (table.kind!=Token::id::name_token) error("table name expected in ",t.name);
+          if (!ts.get().is_symbol(',')) error("',' expected");
+          pending.back().table = table.name;
+          pending.back().args = 2;
+        }
+      }
+      else if (t.is_symbol('(')) pending.push_back(Pending(Pending::id::paren));
+      else if (t.is_symbol('-')) pending.push_back(Pending(Pending::id::negate));
+      else if (t.is_symbol('+')) {}
+      else if (t.kind==Token::id::number || t.kind==Token::id::name_token) {
+        if (t.kind==Token::id::number) code.push_back(Instruction(t.value));
+        else code.push_back(Instruction(Instruction::id::load,t.name));
+        operand_done(code, pending);
+        operand = false;
+      }
+      else error("primary expected");
+      continue;
+    }
 
-    cin >> option;
+    if (t.is_symbol('+') || t.is_symbol('-')) {
+      reduce(code, pending, 1);
+      pending.push_back(Pending(t.is_symbol('+') ? Instruction::id::add : Instruction::id::subtract, 1));
+      operand = true;
+    }
+    else if (t.is_symbol('*') || t.is_symbol('/') || t.is_symbol('%')) {
+      reduce(code, pending, 2);
+      pending.push_back(Pending(
+        t.is_symbol('*') ? Instruction::id::multiply :
+        t.is_symbol('/') ? Instruction::id::divide : Instruction::id::modulo, 2));
+      operand = true;
+    }
+    else if (t.is_symbol(')') || t.is_symbol(',')) {
+      reduce(code, pending, 0);
+      if (pending.empty()) { ts.unget(t); return; }
+      Pending& frame = pending.back();
+      if (frame.kind==Pending::id::paren) {
+        if (t.is_symbol(',')) error("'(' expected");
+      }
+      else if (t.is_symbol(',')) {
+        if (frame.args==2) error("')' expected");
+        frame.args = 2;
+        operand = true;
+        continue;
+      }
+      else finish_call(code, frame);
+      pending.pop_back();
+      operand_done(code, pending);
+    }
+    else {
+      reduce(code, pending, 0);
+      if (!pending.empty()) error(pending.back().kind==Pending::id::paren ? "'(' expected" : "')' expected");
+      ts.unget(t);
+      return;
+    }
+  }
+}
 
-    switch (option){
-      case 1:
-        save_precision = 6;
-        loop = false;
+double run(const Code& code)
+{
+  vector<double> stack;
+  for (const Instruction& in : code)
+  {
+    switch (in.kind)
+    {
+      case Instruction::id::literal:
+        stack.push_back(in.value);
         break;
-      case 2:
-        save_precision = 12;
-        loop = false;
+      case Instruction::id::load:
+        stack.push_back(get_value(in.name));
         break;
-      case 3:
-        save_precision = 19;
-        loop = false;
+      case Instruction::id::load_slot:
+        stack.push_back(in.slot->value);
         break;
-      default:
-        cout << "\nInvalid option. Please select 1, 2, or 3: ";
+      case Instruction::id::negate:
+        stack.back() = -stack.back();
+        break;
+      case Instruction::id::call:
+        stack.back() = in.function(stack.back());
         break;
+      case Instruction::id::lookup:
+      case Instruction::id::interp:
+      case Instruction::id::spline:
+        stack.back() = apply_table(in, stack.back());
+        break;
+      default:
+      {
+        double right = stack.back();
+        stack.pop_back();
+        double& left = stack.back();
+        switch (in.kind)
+        {
+          case Instruction::id::add: left += right; break;
+          case Instruction::id::subtract: left -= right; break;
+          case Instruction::id::multiply: left *= right; break;
+          case Instruction::id::divide:
+            if (right == 0) error("divide by zero");
+            left /= right;
+            break;
+          case Instruction::id::modulo:
+            if (right == 0) error("divide by zero");
+            left = fmod(left,right);
+            break;
+          case Instruction::id::power: left = pow(left,right); break;
+          default: error("run: bad instruction");
+        }
+      }
     }
   }
+  return stack.back();
+}
 
-  ofstream out(filename);
-  if (!out) {
-    error("\nsave env: Could not open file for writing\n");
-  }
-
-  out.setf(ios::fixed);
-  out.precision(save_precision);
-
-  out << "Precision = " << save_precision << endl;
+const size_t column_block = 256;
 
-  for (const auto& [key, val] : names) {
-    out << key << " = " << val.value << " is_const = " << val.is_const << endl;
+size_t stack_depth(const Code& code)
+{
+  size_t depth = 0, max_depth = 0;
+  for (const Instruction& in : code) {
+    if (in.kind<=Instruction::id::load_column) ++depth;
+    else if (in.kind!=Instruction::id::negate && in.kind!=Instruction::id::call && !uses_table(in)) --depth;
+    max_depth = max(max_depth, depth);
   }
-
-  out.close();
-  cout << "\nEnvironment saved to " << filename << " with precision of " << save_precision << " digits.\n\n";
+  return max_depth;
 }
 
-void load_env(string filename)
+void run_columns(const Code& code, const vector<const double*>& columns, size_t n, double* out)
 {
-  ifstream in(filename);
-  if (!in) {
+  vector<double> stack(stack_depth(code) * column_block);
+  for (size_t start = 0; start < n; start += column_block)
+  {
+    size_t m = min(column_block, n - start);
+    double* top = stack.data();
+    for (const Instruction& in : code)
+    {
+      switch (in.kind)
+      {
+        case Instruction::id::literal:
+          fill(top, top + m, in.value);
+          top += column_block;
+          break;
+        case Instruction::id::load_column:
+          copy(columns[in.column] + start, columns[in.column] + start + m, top);
+          top += column_block;
+          break;
+        case Instruction::id::negate:
+          for (double* v = top - column_block; v != top - column_block + m; ++v) *v = -*v;
+          break;
+        case Instruction::id::call:
+          for (double* v = top - column_block; v != top - column_block + m; ++v) *v = in.function(*v);
+          break;
+        case Instruction::id::lookup:
+        case Instruction::id::interp:
+        case Instruction::id::spline:
+        {
+          const Table& t = in.table ? *in.table : get_table(in.name);
+          double* first = top - column_block;
+          if (in.kind==Instruction::id::lookup) for (double* v = first; v != first + m; ++v) *v = lookup(t, *v);
+          else if (in.kind==Instruction::id::interp) for (double* v = first; v != first + m; ++v) *v = interpolate(t, *v);
+          else for (double* v = first; v != first + m; ++v) *v = spline(t, *v);
+          break;
+        }
+        default:
+        {
+          top -= column_block;
+          const double* right = top;
+          double* left = top - column_block;
+          switch (in.kind)
+          {
+            case Instruction::id::add: for (size_t i = 0; i < m; ++i) left[i] += right[i]; break;
+            case Instruction::id::subtract: for (size_t i = 0; i < m; ++i) left[i] -= right[i]; break;
+            case Instruction::id::multiply: for (size_t i = 0; i < m; ++i) left[i] *= right[i]; break;
+            case Instruction::id::divide:
+              for (size_t i = 0; i < m; ++i) if (right[i] == 0) error("divide by zero");
+              for (size_t i = 0; i < m; ++i) left[i] /= right[i];
+              break;
+            case Instruction::id::modulo:
+              for (size_t i = 0; i < m; ++i) if (right[i] == 0) error("divide by zero");
+              for (size_t i = 0; i < m; ++i) left[i] = fmod(left[i],right[i]);
+              break;
+            case Instruction::id::power: for (size_t i = 0; i < m; ++i) left[i] = pow(left[i],right[i]); break;
+            default: error("run: instruction not supported on columns");
+          }
+        }
+      }
+    }
+    copy(stack.data(), stack.data() + m, out + start);
+  }
+}
+
+unsigned long long hash_text(const string& text)
+{
+  unsigned long long h = 14695981039346656037ull;
+  for (unsigned char c : text) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// With -N, column formulas are translated to C++, built by the system
+// compiler into a shared object, and loaded with dlopen. Objects are cached
+// in a directory only the user can write, keyed by the source, the
+// compiler, the flags and the CPU they were built for. Anything that fails
+// falls back to run_columns().
+using Native_formula = int(const double* const*, size_t, double*);
+
+bool native = false;
+map<unsigned long long,Native_formula*> native_formulas;
+unsigned long native_builds = 0;
+unsigned long native_loads = 0;
+unsigned long native_fallbacks = 0;
+
+string native_source(const Code& code)
+{
+  ostringstream body;
+  body << hexfloat;
+  size_t depth = 0;
+  for (const Instruction& in : code)
+  {
+    string top = "s" + to_string(depth ? depth - 1 : 0);
+    switch (in.kind)
+    {
+      case Instruction::id::literal:
+        body << "    s" << depth++ << " = " << in.value << ";\n";
+        break;
+      case Instruction::id::load_column:
+        body << "    s" << depth++ << " = c[" << in.column << "][i];\n";
+        break;
+      case Instruction::id::negate:
+        body << "    " << top << " = -" << top << ";\n";
+        break;
+      case Instruction::id::call:
+        body << "    " << top << " = std::" << (in.name == "ln" ? string("log") : in.name) << "(" << top << ");\n";
+        break;
+      case Instruction::id::add:
+      case Instruction::id::subtract:
+      case Instruction::id::multiply:
+      case Instruction::id::divide:
+      case Instruction::id::modulo:
+      case Instruction::id::power:
+      {
+        string right = "s" + to_string(--depth);
+        string left = "s" + to_string(depth - 1);
+        if (in.kind==Instruction::id::divide || in.kind==Instruction::id::modulo)
+          body << "    bad |= (" << right << " == 0);\n";
+        body << "    " << left << " = ";
+        switch (in.kind)
+        {
+          case Instruction::id::add: body << left << " + " << right; break;
+          case Instruction::id::subtract: body << left << " - " << right; break;
+          case Instruction::id::multiply: body << left << " * " << right; break;
+          case Instruction::id::divide: body << left << " / " << right; break;
+          case Instruction::id::modulo: body << "std::fmod(" << left << ", " << right << ")"; break;
+          default: body << "std::pow(" << left << ", " << right << ")";
+        }
+        body << ";\n";
+        break;
+      }
+      default:
+        return "";
+    }
+  }
+
+  ostringstream source;
+  source << "#include <cmath>\n#include <cstddef>\n\n"
+         << "extern \"C\" int calc_formula(const double* const* c, std::size_t n, double* out)\n{\n"
+         << "  int bad = 0;\n  for (std::size_t i = 0; i < n; ++i) {\n    double";
+  for (size_t i = 0; i < max<size_t>(stack_depth(code), 1); ++i) source << (i ? ", s" : " s") << i;
+  source << ";\n" << body.str() << "    out[i] = s0;\n  }\n  return bad;\n}\n";
+  return source.str();
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+extern "C" char** environ;
+
+// True for a file or directory that is no symlink, is owned by this user
+// and cannot be written by anyone else.
+bool owned_privately(const string& path, bool directory)
+{
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0 || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) return false;
+  return directory ? S_ISDIR(st.st_mode) && !(st.st_mode & (S_IRWXG | S_IRWXO)) : S_ISREG(st.st_mode);
+}
+
+// $XDG_CACHE_HOME/calc-native, else ~/.cache/calc-native, else a
+// calc-native-<uid> directory in TMPDIR; empty if none is private.
+string native_cache_dir()
+{
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  const char* tmp = getenv("TMPDIR");
+  string dir;
+  if (xdg && *xdg) dir = string(xdg) + "/calc-native";
+  else if (home && *home) dir = string(home) + "/.cache/calc-native";
+  else dir = string(tmp && *tmp ? tmp : "/tmp") + "/calc-native-" + to_string(getuid());
+  error_code ec;
+  filesystem::create_directories(filesystem::path(dir).parent_path(), ec);
+  mkdir(dir.c_str(), 0700);
+  return owned_privately(dir, true) ? dir : "";
+}
+
+// The parts of /proc/cpuinfo that -march=native depends on.
+string cpu_signature()
+{
+  static const char* keys[] = {"vendor_id", "cpu family", "model", "model name", "stepping", "flags",
+                               "Features", "CPU implementer", "CPU architecture", "CPU variant", "CPU part"};
+  ifstream in("/proc/cpuinfo");
+  string signature;
+  for (string line; getline(in, line) && !line.empty();) {
+    string key = line.substr(0, line.find(':'));
+    key.erase(key.find_last_not_of(" \t") + 1);
+    if (find(begin(keys), end(keys), key) != end(keys)) signature += line + '\n';
+  }
+  return signature;
+}
+
+// Runs the compiler without a shell, with its diagnostics discarded.
+bool run_compiler(vector<string> args)
+{
+  vector<char*> argv;
+  for (string& a : args) argv.push_back(&a[0]);
+  argv.push_back(nullptr);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  pid_t pid;
+  int spawned = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (spawned != 0) return false;
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR) return false;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#endif
+
+Native_formula* native_formula(const Code& code)
+{
+  if (!native) return nullptr;
+#if defined(__unix__) || defined(__APPLE__)
+  string source = native_source(code);
+  if (source.empty()) { ++native_fallbacks; return nullptr; }
+  unsigned long long h = hash_text(source);
+  auto p = native_formulas.find(h);
+  if (p != native_formulas.end()) return p->second;
+
+  static const string dir = native_cache_dir();
+  static const string cpu = cpu_signature();
+  const vector<string> flags = {"-std=c++17", "-O3", "-march=native", "-ffp-contract=off", "-shared", "-fPIC"};
+  vector<string> command;
+  const char* cxx = getenv("CXX");
+  istringstream words(cxx && *cxx ? cxx : "c++");
+  for (string w; words >> w;) command.push_back(w);
+  if (dir.empty() || command.empty()) { ++native_fallbacks; return native_formulas[h] = nullptr; }
+
+  string key = source;
+  for (const string& w : command) key += '\n' + w;
+  for (const string& f : flags) key += '\n' + f;
+  key += '\n' + cpu;
+  ostringstream name;
+  name << dir << "/" << hex << hash_text(key) << ".so";
+  string library = name.str();
+
+  if (!owned_privately(library, false)) {
+    string build = dir + "/build-XXXXXX";
+    if (!mkdtemp(&build[0])) { ++native_fallbacks; return native_formulas[h] = nullptr; }
+    { ofstream out(build + "/formula.cpp"); out << source; }
+    command.insert(command.end(), flags.begin(), flags.end());
+    command.insert(command.end(), {"-o", build + "/formula.so", build + "/formula.cpp"});
+    bool built = run_compiler(command);
+    error_code ec;
+    if (built) filesystem::rename(build + "/formula.so", library, ec);
+    filesystem::remove_all(build, ec);
+    if (!built || !owned_privately(library, false)) {
+      ++native_fallbacks;
+      return native_formulas[h] = nullptr;
+    }
+    ++native_builds;
+  }
+
+  void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+  void* symbol = handle ? dlsym(handle, "calc_formula") : nullptr;
+  if (!symbol) { ++native_fallbacks; return native_formulas[h] = nullptr; }
+  ++native_loads;
+  return native_formulas[h] = reinterpret_cast<Native_formula*>(symbol);
+#else
+  ++native_fallbacks;
+  return nullptr;
+#endif
+}
+
+void evaluate_columns(const Code& code, Native_formula* formula, const vector<const double*>& columns, size_t n, double* out)
+{
+  if (!formula) run_columns(code, columns, n, out);
+  else if (formula(columns.data(), n, out)) error("divide by zero");
+}
+
+Statement assign()
+{
+  Token t=ts.get();
+  if(t.kind!=Token::id::name_token) error ("name expected in assign");
+  string name = t.name;
+  t=ts.get();
+  if(!t.is_symbol('=')) error("= missing in assign of " ,name);
+  Code code;
+  expression(code);
+  return Statement(Statement::id::assignment,name,code);
+}
+
+Statement constant_assign()
+{
+  Token t=ts.get();
+  if(t.kind!=Token::id::name_token) error("name expected in const assign");
+  string name = t.name;
+  t=ts.get();
+  if(!t.is_symbol('=')) error("= missing in assign of " ,name);
+  Code code;
+  expression(code);
+  return Statement(Statement::id::constant,name,code);
+}
+
+Statement compile()
+{
+  Token t=ts.get();
+  switch(t.kind)
+  {
+    case Token::id::const_token:
+      return constant_assign();
+    case Token::id::name_token:
+      {
+        Token tt=ts.get();
+        ts.unget(tt); 
+        ts.unget(t); 
+        if(tt.is_symbol('=')) return assign();
+        break;
+      }
+    default:
+      ts.unget(t);
+  }
+  Code code;
+  expression(code);
+  return Statement(Statement::id::expression,"",code);
+}
+
+bool starts_statement(const Token& t)
+{
+  return (
+    t.kind==Token::id::const_token ||
+    t.kind==Token::id::name_token ||
+    t.kind==Token::id::number ||
+    t.kind==Token::id::char_token ||
+    t.kind==Token::id::function_token
+  );
+}
+
+void check_store(const Statement& s)
+{
+  if (s.kind==Statement::id::assignment && is_constant(s.name)) error(s.name," constant cannot be modified"); 
+  if (s.kind==Statement::id::constant && is_declared(s.name)) error(s.name," has already been defined"); 
+}
+
+double store(const Statement& s, double d)
+{
+  switch(s.kind)
+  {
+    case Statement::id::assignment:
+      if(is_declared(s.name)) 
+        set_value(s.name,d);
+      else
+        define_name(s.name,d);
+      break;
+    case Statement::id::constant:
+      define_name(s.name,d,true);
+      break;
+    default:
+      break;
+  }
+  return d;
+}
+
+double execute(const Statement& s)
+{
+  check_store(s);
+  return store(s, run(s.code));
+}
+
+Code fold(const Code& code, const map<string,double>& known)
+{
+  Code folded;
+  vector<bool> constant;
+  for (const Instruction& in : code)
+  {
+    switch (in.kind)
+    {
+      case Instruction::id::literal:
+        folded.push_back(in);
+        constant.push_back(true);
+        break;
+      case Instruction::id::load:
+        {
+          auto p = known.find(in.name);
+          if (p != known.end()) folded.push_back(Instruction(p->second));
+          else folded.push_back(in);
+          constant.push_back(p != known.end());
+          break;
+        }
+      case Instruction::id::lookup:
+      case Instruction::id::interp:
+      case Instruction::id::spline:
+        folded.push_back(in);
+        constant.back() = false;
+        break;
+      case Instruction::id::negate:
+      case Instruction::id::call:
+        folded.push_back(in);
+        if (constant.back()) {
+          Code one{folded[folded.size()-2], in};
+          folded.pop_back();
+          folded.back() = Instruction(run(one));
+        }
+        break;
+      default:
+        {
+          bool both = constant.back() && constant[constant.size()-2];
+          constant.pop_back();
+          constant.back() = both;
+          bool by_zero = (in.kind==Instruction::id::divide || in.kind==Instruction::id::modulo)
+            && folded.back().kind==Instruction::id::literal && folded.back().value==0;
+          if (both && !by_zero) {
+            Code three{folded[folded.size()-2], folded.back(), in};
+            folded.pop_back();
+            folded.back() = Instruction(run(three));
+          }
+          else {
+            if (by_zero) constant.back() = false;
+            folded.push_back(in);
+          }
+        }
+    }
+  }
+  return folded;
+}
+
+bool can_throw(const Code& code, const set<string>& defined)
+{
+  for (size_t i = 0; i < code.size(); ++i) {
+    const Instruction& in = code[i];
+    if (in.kind==Instruction::id::load && !is_declared(in.name) && defined.count(in.name)==0) return true;
+    if (uses_table(in)) return true;
+    if (in.kind==Instruction::id::divide || in.kind==Instruction::id::modulo) {
+      const Instruction& divisor = code[i-1];
+      if (divisor.kind!=Instruction::id::literal || divisor.value==0) return true;
+    }
+  }
+  return false;
+}
+
+void optimize_block(vector<Statement>& block)
+{
+  map<string,double> known;
+  set<string> defined;
+  set<string> constants;
+  vector<bool> stores(block.size(), false);
+  vector<bool> removable(block.size(), false);
+  vector<bool> kills(block.size(), false);
+
+  for (size_t i = 0; i < block.size(); ++i) {
+    Statement& s = block[i];
+    s.code = fold(s.code, known);
+    if (s.kind==Statement::id::expression) continue;
+
+    bool fails = (s.kind==Statement::id::assignment)
+      ? (is_constant(s.name) || constants.count(s.name)>0)
+      : (is_declared(s.name) || defined.count(s.name)>0);
+    if (fails) continue;
+
+    bool safe = !can_throw(s.code, defined);
+    stores[i] = true;
+    kills[i] = safe;
+    removable[i] = (s.kind==Statement::id::assignment) && safe;
+    if (s.code.size()==1 && s.code[0].kind==Instruction::id::literal) known[s.name] = s.code[0].value;
+    else known.erase(s.name);
+    if (safe) defined.insert(s.name);
+    if (s.kind==Statement::id::constant) constants.insert(s.name);
+  }
+
+  set<string> overwritten;
+  vector<Statement> live;
+  for (size_t i = block.size(); i-- > 0;) {
+    const Statement& s = block[i];
+    if (removable[i] && overwritten.count(s.name)>0) continue;
+    if (kills[i]) overwritten.insert(s.name);
+    for (const Instruction& in : s.code)
+      if (in.kind==Instruction::id::load) overwritten.erase(in.name);
+    live.push_back(s);
+  }
+  block.assign(live.rbegin(), live.rend());
+}
+
+void set_precision()
+{
+  Token t = ts.get();
+  if (t.kind != Token::id::number)
+    error("Expected a number after 'set precision'");
+  int digits = static_cast<int>(t.value);
+  if (digits < 0 || digits > 20)
+    error("Precision must be between 0 and 20");
+  current_precision = digits;
+  cout << "Precision set to " << digits << " digits." << endl;
+}
+
+void show_precision()
+{
+  cout << "Current precision: " << current_precision << " digits." << endl;
+}
+
+void set_precision(int digits)
+{
+  if (digits < 0 || digits > 20)
+    error("Precision must be between 0 and 20");
+  current_precision = digits;
+  cout.setf(ios::fixed);
+  cout.precision(current_precision);
+}
+
+void show_env()
+{
+  if (names.empty()) {
+    error("\nshow env: (none)\n");
+  }
+
+  cout << "\nCurrent environment:" << endl << endl;
+  for (const auto& [key, val] : names) {
+    cout << "  " << key << " = " << val.value;
+    if (val.is_const) cout << " (const)";
+    cout << endl << endl;
+  }
+}
+
+template<class T> void write_raw(ostream& out, T v)
+{ out.write(reinterpret_cast<const char*>(&v), sizeof v); }
+
+void write_string(ostream& out, const string& s)
+{
+  write_raw<unsigned int>(out, s.size());
+  out.write(s.data(), s.size());
+}
+
+struct Reader
+{
+  const string& data;
+  size_t pos;
+
+  Reader(const string& d) : data(d), pos(0) {}
+
+  size_t left() const { return data.size() - pos; }
+
+  template<class T> T get()
+  {
+    if (pos + sizeof(T) > data.size()) error("cache: truncated file");
+    T v;
+    data.copy(reinterpret_cast<char*>(&v), sizeof v, pos);
+    pos += sizeof v;
+    return v;
+  }
+
+  string get_string()
+  {
+    unsigned int n = get<unsigned int>();
+    if (pos + n > data.size()) error("cache: truncated file");
+    pos += n;
+    return data.substr(pos - n, n);
+  }
+};
+
+void write_code(ostream& out, const Code& code)
+{
+  write_raw<unsigned int>(out, code.size());
+  for (const Instruction& in : code) {
+    write_raw<unsigned char>(out, in.kind);
+    if (in.kind==Instruction::id::literal) write_raw(out, in.value);
+    if (in.kind==Instruction::id::load || in.kind==Instruction::id::call || uses_table(in))
+      write_string(out, in.name);
+  }
+}
+
+Code read_code(Reader& in)
+{
+  Code code;
+  unsigned int n = in.get<unsigned int>();
+  if (n > in.left()) error("cache: truncated file");
+  code.reserve(n);
+  size_t depth = 0;
+  for (unsigned int i = 0; i < n; ++i) {
+    unsigned char op = in.get<unsigned char>();
+    if (op > Instruction::id::spline || op == Instruction::id::load_slot || op == Instruction::id::load_column)
+      error("cache: bad instruction");
+    auto kind = static_cast<Instruction::id>(op);
+    bool binary = kind>=Instruction::id::add && kind<=Instruction::id::power && kind!=Instruction::id::call;
+    size_t operands = binary ? 2 : (kind<=Instruction::id::load ? 0 : 1);
+    if (depth < operands) error("cache: bad instruction");
+    depth = depth - operands + 1;
+    if (kind==Instruction::id::literal) code.push_back(Instruction(in.get<double>()));
+    else if (kind==Instruction::id::load || kind>=Instruction::id::lookup) code.push_back(Instruction(kind, in.get_string()));
+    else if (kind==Instruction::id::call) {
+      string name = in.get_string();
+      auto f = functions.find(name);
+      if (f == functions.end() || !f->second) error("cache: unknown function ",name);
+      code.push_back(Instruction(kind, name, f->second));
+    }
+    else code.push_back(Instruction(kind));
+  }
+  if (depth != 1) error("cache: bad instruction");
+  return code;
+}
+
+string read_file(string filename)
+{
+  ifstream in(filename, ios::binary);
+  if (!in) error("Could not open ",filename);
+  in.seekg(0, ios::end);
+  streamoff size = in.tellg();
+  if (size < 0) {
+    in.clear();
+    ostringstream stream;
+    stream << in.rdbuf();
+    return stream.str();
+  }
+  string content(static_cast<size_t>(size), '\0');
+  in.seekg(0);
+  in.read(&content[0], content.size());
+  return content;
+}
+
+const string image_magic = "CALCI";
+const unsigned int image_version = 2;
+
+int leading_zeros(unsigned long long x)
+{
+  int n = 0;
+  for (int shift = 32; shift > 0; shift /= 2)
+    if ((x >> (64 - shift)) == 0) { n += shift; x <<= shift; }
+  return n;
+}
+
+int trailing_zeros(unsigned long long x)
+{
+  int n = 0;
+  for (int shift = 32; shift > 0; shift /= 2)
+    if ((x & ((1ULL << shift) - 1)) == 0) { n += shift; x >>= shift; }
+  return n;
+}
+
+struct Bit_writer
+{
+  string bytes;
+  unsigned long long pending;
+  int used;
+
+  Bit_writer() : bytes(), pending(0), used(0) {}
+
+  void put(unsigned long long v, int n)
+  {
+    if (n > 32) { put(v >> 32, n - 32); n = 32; }
+    pending = (pending << n) | (v & ((1ULL << n) - 1));
+    used += n;
+    while (used >= 8) {
+      used -= 8;
+      bytes += char(pending >> used);
+    }
+  }
+
+  void flush() { if (used > 0) put(0, 8 - used); }
+};
+
+struct Bit_reader
+{
+  const unsigned char* p;
+  const unsigned char* end;
+  unsigned long long buffer;
+  int available;
+
+  Bit_reader(const string& data, size_t pos)
+  : p(reinterpret_cast<const unsigned char*>(data.data()) + pos),
+    end(reinterpret_cast<const unsigned char*>(data.data()) + data.size()), buffer(0), available(0)
+  {}
+
+  unsigned long long get(int n)
+  {
+    if (n > 32) {
+      unsigned long long high = get(n - 32);
+      return (high << 32) | get(32);
+    }
+    while (available < n) {
+      if (p == end) error("load image: truncated file");
+      buffer = (buffer << 8) | *p++;
+      available += 8;
+    }
+    available -= n;
+    return (buffer >> available) & ((1ULL << n) - 1);
+  }
+};
+
+// Values are XOR-delta coded against the previous one (Gorilla): an unchanged
+// value costs one bit, a value sharing its sign, exponent and high mantissa
+// bits only pays for the bits that differ.
+struct Value_encoder
+{
+  Bit_writer out;
+  unsigned long long previous;
+  int lead;
+  int trail;
+  bool first;
+
+  Value_encoder() : out(), previous(0), lead(-1), trail(0), first(true) {}
+
+  void put(double d)
+  {
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof bits);
+    unsigned long long x = bits ^ previous;
+    previous = bits;
+    if (first) { out.put(bits, 64); first = false; return; }
+    if (x == 0) { out.put(0, 1); return; }
+
+    int l = min(leading_zeros(x), 31), t = trailing_zeros(x);
+    if (lead >= 0 && l >= lead && t >= trail) {
+      out.put(2, 2);
+      out.put(x >> trail, 64 - lead - trail);
+      return;
+    }
+    lead = l;
+    trail = t;
+    out.put(3, 2);
+    out.put(lead, 5);
+    out.put(63 - lead - trail, 6);
+    out.put(x >> trail, 64 - lead - trail);
+  }
+};
+
+struct Value_decoder
+{
+  Bit_reader& in;
+  unsigned long long previous;
+  int lead;
+  int trail;
+  bool first;
+
+  Value_decoder(Bit_reader& r) : in(r), previous(0), lead(0), trail(0), first(true) {}
+
+  double get()
+  {
+    if (first) first = false;
+    else if (in.get(1) == 0) return as_double(previous);
+    else if (in.get(1) == 1) {
+      lead = in.get(5);
+      trail = 63 - lead - int(in.get(6));
+      if (trail < 0) error("load image: corrupt value");
+    }
+    previous ^= in.get(64 - lead - trail) << trail;
+    return as_double(previous);
+  }
+
+  static double as_double(unsigned long long bits)
+  {
+    double d;
+    memcpy(&d, &bits, sizeof d);
+    return d;
+  }
+};
+
+void write_varint(string& out, unsigned long long v)
+{
+  for (; v >= 128; v >>= 7) out += char(v | 128);
+  out += char(v);
+}
+
+unsigned long long read_varint(Reader& in)
+{
+  unsigned long long v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    unsigned char b = in.get<unsigned char>();
+    v |= static_cast<unsigned long long>(b & 127) << shift;
+    if (b < 128) return v;
+  }
+  error("load image: corrupt length");
+  return 0;
+}
+
+void save_image(string filename)
+{
+  ofstream out(filename, ios::binary);
+  if (!out) error("save image: Could not open file for writing");
+
+  // Names arrive sorted, so each one stores only what differs from the last.
+  string keys;
+  Value_encoder values;
+  string previous;
+  for (const auto& [key, val] : names) {
+    size_t shared = 0;
+    while (shared < key.size() && shared < previous.size() && key[shared] == previous[shared]) ++shared;
+    write_varint(keys, shared);
+    write_varint(keys, key.size() - shared);
+    keys.append(key, shared, string::npos);
+    previous = key;
+    values.out.put(val.is_const, 1);
+    values.put(val.value);
+  }
+  values.out.flush();
+
+  out.write(image_magic.data(), image_magic.size());
+  write_raw(out, image_version);
+  write_raw(out, current_precision);
+  write_raw<unsigned long long>(out, names.size());
+  write_raw<unsigned long long>(out, keys.size());
+  out.write(keys.data(), keys.size());
+  out.write(values.out.bytes.data(), values.out.bytes.size());
+
+  size_t bytes = out.tellp();
+  out.close();
+  cout << "\nSession image saved to " << filename << " (" << names.size() << " names, " << bytes << " bytes).\n\n";
+}
+
+void load_image(string filename)
+{
+  string data = read_file(filename);
+  Reader in(data);
+  if (data.compare(0, image_magic.size(), image_magic) != 0) error("load image: not a session image");
+  in.pos = image_magic.size();
+  unsigned int version = in.get<unsigned int>();
+  if (version != 1 && version != image_version) error("load image: unsupported image version");
+
+  int precision = in.get<int>();
+  if (precision < 0 || precision > 20) error("load image: bad precision");
+  auto n = in.get<unsigned long long>();
+  if (n > in.left()) error("load image: truncated file");
+
+  // The whole image is decoded before anything is applied, so a damaged
+  // image leaves the session as it was.
+  vector<Value> entries;
+  entries.reserve(n);
+  auto define = [&](const string& name, double value, bool is_const) {
+    if (!entries.empty() && !(entries.back().name < name)) error("load image: names out of order");
+    entries.push_back(Value(name, value, is_const));
+  };
+
+  if (version == 1) {
+    for (unsigned long long i = 0; i < n; ++i) {
+      string name = in.get_string();
+      double value = in.get<double>();
+      bool is_const = in.get<unsigned char>();
+      define(name, value, is_const);
+    }
+  }
+  else {
+    auto keys_size = in.get<unsigned long long>();
+    if (keys_size > data.size() - in.pos) error("load image: truncated file");
+    Bit_reader bits(data, in.pos + keys_size);
+    Value_decoder values(bits);
+    string name;
+    for (unsigned long long i = 0; i < n; ++i) {
+      auto shared = read_varint(in);
+      auto suffix = read_varint(in);
+      if (shared > name.size() || suffix > data.size() - in.pos) error("load image: corrupt name");
+      name.resize(shared);
+      name.append(data, in.pos, suffix);
+      in.pos += suffix;
+      bool is_const = bits.get(1);
+      define(name, values.get(), is_const);
+    }
+  }
+
+  set_precision(precision);
+  // Entries are in name order, so the insert position only moves forward.
+  auto hint = names.begin();
+  for (const Value& v : entries) {
+    while (hint != names.end() && hint->first < v.name) ++hint;
+    if (hint != names.end() && hint->first == v.name) redefine_name(v.name, v.value, v.is_const);
+    else names.emplace_hint(hint, v.name, v);
+  }
+  cout << "\nSession image loaded from " << filename << " (" << n << " names).\n\n";
+}
+
+void save_env(string filename)
+{
+  if (names.empty()) {
+    error("\nsave env: No variables or constants to save.\n");
+  }
+
+  cout 
+    << "\n Enter precision for saving:"
+    << "\n"
+    << "\n1. Default (6 digits)"
+    << "\n2. Medium (12 digits)"
+    << "\n3. High (19 digits)";
+  cout << "\n\nSelect option (1-3): ";
+
+  int option;
+  int save_precision;
+  bool loop = true;
+
+  while (loop){
+    cin.clear();
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+    cin >> option;
+
+    switch (option){
+      case 1:
+        save_precision = 6;
+        loop = false;
+        break;
+      case 2:
+        save_precision = 12;
+        loop = false;
+        break;
+      case 3:
+        save_precision = 19;
+        loop = false;
+        break;
+      default:
+        cout << "\nInvalid option. Please select 1, 2, or 3: ";
+        break;
+    }
+  }
+
+  ofstream out(filename);
+  if (!out) {
+    error("\nsave env: Could not open file for writing\n");
+  }
+
+  out.setf(ios::fixed);
+  out.precision(save_precision);
+
+  out << "Precision = " << save_precision << endl;
+
+  for (const auto& [key, val] : names) {
+    out << key << " = " << val.value << " is_const = " << val.is_const << endl;
+  }
+
+  out.close();
+  cout << "\nEnvironment saved to " << filename << " with precision of " << save_precision << " digits.\n\n";
+}
+
+void load_env(string filename)
+{
+  ifstream in(filename);
+  if (!in) {
     error("\nload env: Could not open file for reading\n");
   }
 
-  string line;
+  string line;
+
+  if (getline(in, line)) {
+    istringstream header(line);
+    string label, eq;
+    int file_precision;
+    header >> label >> eq >> file_precision;
+
+    cout << "\nThe file specifies a precision of " << file_precision << " digits.";
+    cout << "\nDo you want to apply this precision to future outputs?";
+    cout << "\n\n 1. Yes";
+    cout << "\n 2. No";
+    cout << "\n\nSelect option (1-2): ";
+
+    int option;
+    bool loop = true;
+    while (loop) {
+      cin.clear();
+      cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+      cin >> option;
+
+      switch(option){
+        case 1:
+          set_precision(file_precision);
+          cout << "\nPrecision set to " << current_precision << " digits.\n";
+          loop = false;
+          break;
+        case 2:
+          cout << "\nKeeping current precision of " << current_precision << " digits.\n";
+          loop = false;
+          break;
+        default:
+          cout << "\nInvalid option. Please select 1 or 2: ";
+          break;
+      }
+    }
+  }
+
+  while (getline(in, line)){
+    istringstream stream(line);
+    string name, eq, is_const_str;
+    double value;
+    int is_const;
+
+    stream >> name >> eq >> value >> is_const_str >> eq >> is_const;
+
+    if (name.empty()) continue;
+
+    if (!is_declared(name)){
+      define_name(name, value, is_const);
+      cout << "\nLoaded variable : " << name << " = " << value << "\n(const: " << (is_const ? "yes" : "no") << ")\n";
+    }
+    else{
+      cout << "\nConflict detected for variable: " << name << "." << endl;
+      cout << "\nExisting value: " << get_value(name) << "\n(const: " << (is_constant(name) ? "yes" : "no") << ")\n";
+      cout << "\nFile value: " << value << "\n(const: " << (is_const ? "yes" : "no") << ")\n";
+
+      cout << "\nChoose an action:\n";
+      cout << "  \n1. Keep existing value\n";
+      cout << "  \n2. Overwrite with file value\n";
+      cout << "\n\nSelect option (1-2): ";
+
+      int option;
+      bool loop = true;
+
+      while (loop){
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+        cin >> option;
+
+        switch (option){
+          case 1:
+            cout << "\nKeeping existing value for '" << name << "'.\n";
+            loop = false;
+            break;
+          case 2:
+            redefine_name(name, value, is_const);
+            cout << "\nOverwritten '" << name << "' with value from file.\n";
+            loop = false;
+            break;
+          default:
+            cout << "\nInvalid option. Please select 1, or 2: ";
+            break;
+        }
+      }
+    }
+  }
+
+  in.close();
+  cout << "\nEnvironment loaded from " << filename << ".\n\n";
+}
+
+string watched_env;
+filesystem::file_time_type watched_time;
+map<string,pair<double,bool>> watched_values;
+unsigned long env_reloads = 0;
+
+map<string,pair<double,bool>> read_env_entries(const string& filename)
+{
+  ifstream in(filename);
+  if (!in) error("watch env: Could not open ",filename);
+
+  map<string,pair<double,bool>> entries;
+  string line;
+  getline(in, line);
+  while (getline(in, line)) {
+    istringstream stream(line);
+    string name, eq, is_const_str, eq2;
+    double value;
+    int is_const;
+    if (!(stream >> name)) continue;
+    if (!(stream >> eq >> value >> is_const_str >> eq2 >> is_const)) error("watch env: bad line for ",name);
+    entries[name] = {value, is_const != 0};
+  }
+  return entries;
+}
+
+size_t apply_env(const string& filename)
+{
+  auto entries = read_env_entries(filename);
+  size_t changed = 0;
+  for (const auto& [name, entry] : entries) {
+    auto w = watched_values.find(name);
+    if (w != watched_values.end() && w->second == entry) continue;
+    auto p = names.find(name);
+    if (p == names.end()) names.emplace(name, Value(name, entry.first, entry.second));
+    else {
+      p->second.value = entry.first;
+      p->second.is_const = entry.second;
+      p->second.version = ++version_clock;
+    }
+    ++changed;
+  }
+  watched_values = move(entries);
+  return changed;
+}
+
+void watch_env(const string& filename)
+{
+  error_code ec;
+  auto time = filesystem::last_write_time(filename, ec);
+  if (ec) error("watch env: Could not open ",filename);
+  watched_values.clear();
+  size_t n = apply_env(filename);
+  watched_env = filename;
+  watched_time = time;
+  cout << "\nWatching " << filename << " (" << n << " names loaded).\n\n";
+}
+
+void check_watched_env()
+{
+  if (watched_env.empty()) return;
+  error_code ec;
+  auto time = filesystem::last_write_time(watched_env, ec);
+  if (ec || time == watched_time) return;
+  watched_time = time;
+  try {
+    size_t n = apply_env(watched_env);
+    ++env_reloads;
+    cout << "\nReloaded " << watched_env << " (" << n << " names changed).\n\n";
+  }
+  catch (runtime_error& e) {
+    cerr << e.what() << endl;
+  }
+}
+
+string read_filename(const string& extension=".txt")
+{
+  char ch;
+  string filename = "";
+
+  cin >> ws;
+  while (cin.get(ch) && ch != ';'){
+    filename += ch;
+  }
+  cin.unget();
+
+  if (filename.empty()) error("Filename expected");
+
+  if (filename.size() < extension.size() || filename.substr(filename.size() - extension.size()) != extension) error("\nFilename must end with "+extension+"\n");
+
+  return filename;
+}
+
+const size_t huge_page = 2 << 20;
+unsigned long long huge_page_bytes = 0;
+bool pin_threads = false;
+
+// Columns of 2 MB or more are aligned to huge pages and advised to use them.
+// Elements are left uninitialised, so the threads that fill a column are
+// the ones that first touch, and place, its pages.
+template<class T>
+struct Column_allocator
+{
+  using value_type = T;
+
+  Column_allocator() = default;
+  template<class U> Column_allocator(const Column_allocator<U>&) {}
+
+  T* allocate(size_t n)
+  {
+    size_t bytes = n * sizeof(T);
+    if (bytes < huge_page) return static_cast<T*>(::operator new(bytes));
+    size_t rounded = (bytes + huge_page - 1) / huge_page * huge_page;
+    void* p = aligned_alloc(huge_page, rounded);
+    if (!p) throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+    if (madvise(p, rounded, MADV_HUGEPAGE) == 0) huge_page_bytes += rounded;
+#endif
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+    if (n * sizeof(T) < huge_page) ::operator delete(p);
+    else free(p);
+  }
+
+  template<class U> void construct(U* p) { ::new (static_cast<void*>(p)) U; }
+  template<class U, class... Args> void construct(U* p, Args&&... args)
+  { ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+};
+
+template<class T, class U> bool operator==(const Column_allocator<T>&, const Column_allocator<U>&) { return true; }
+template<class T, class U> bool operator!=(const Column_allocator<T>&, const Column_allocator<U>&) { return false; }
+
+using Column = vector<double,Column_allocator<double>>;
+
+// A worker process started by -W gets an equal share of the cores.
+size_t process_index = 0;
+size_t process_count = 1;
+
+size_t worker_threads()
+{ return max<size_t>(1, max(1u, thread::hardware_concurrency()) / process_count); }
+
+// Only threads spawned for a job are pinned. The thread that starts the
+// job also runs share 0, but keeps its own affinity.
+void pin_worker(size_t i)
+{
+#ifdef __linux__
+  if (!pin_threads) return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET((process_index * worker_threads() + i) % max(1u, thread::hardware_concurrency()), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+#endif
+}
+
+struct Column_table
+{
+  vector<string> names;
+  vector<Column> columns;
+  size_t rows;
+
+  Column_table() : names(), columns(), rows(0) {}
+};
+
+// A CSV error tied to a row. The parts around the row number are kept so
+// a worker process can report the row to the coordinator, which knows how
+// many rows came before that worker's part of the file.
+struct Row_error : runtime_error
+{
+  string before;
+  size_t row;
+  string after;
+
+  Row_error(const string& b, size_t r, const string& a)
+  : runtime_error(b + to_string(r) + a), before(b), row(r), after(a) {}
+};
+
+const char* end_of_line(const char* p, const char* end)
+{
+  const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+  return nl ? nl : end;
+}
+
+void parse_csv_rows(const char* p, const char* end, size_t first_row, size_t fields,
+                    const vector<int>& target, Column_table& table)
+{
+  size_t row = first_row;
+  while (p < end) {
+    const char* eol = end_of_line(p, end);
+    const char* line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+    if (line_end == p) { p = eol + 1; continue; }
+
+    for (size_t f = 0; f < fields; ++f) {
+      const char* comma = static_cast<const char*>(memchr(p, ',', line_end - p));
+      const char* field_end = comma ? comma : line_end;
+      if ((comma == nullptr) != (f + 1 == fields))
+        throw Row_error("csv: wrong number of fields in row ", row + 1, "");
+      if (target[f] >= 0) {
+        while (p < field_end && *p == ' ') ++p;
+        double& v = table.columns[target[f]][row];
+        auto [last, ec] = from_chars(p, field_end, v);
+        while (last < field_end && *last == ' ') ++last;
+        if (ec != errc() || last != field_end)
+          throw Row_error("csv: bad number in row ", row + 1, ", column " + table.names[target[f]]);
+      }
+      p = field_end + 1;
+    }
+    p = eol + 1;
+    ++row;
+  }
+}
+
+Column_table parse_csv(const string& data, const string& filename, const set<string>& wanted)
+{
+  const char* begin = data.data();
+  const char* end = begin + data.size();
+
+  Column_table table;
+  const char* header_end = end_of_line(begin, end);
+  string header(begin, (header_end > begin && header_end[-1] == '\r') ? header_end - 1 : header_end);
+  vector<int> target;
+  istringstream fields(header);
+  for (string name; getline(fields, name, ',');) {
+    name.erase(0, name.find_first_not_of(' '));
+    name.erase(name.find_last_not_of(' ') + 1);
+    if (wanted.count(name)) {
+      target.push_back(table.names.size());
+      table.names.push_back(name);
+    }
+    else target.push_back(-1);
+  }
+  if (target.empty()) error("csv: missing header in ", filename);
+
+  const char* body = (header_end < end) ? header_end + 1 : end;
+  size_t threads = worker_threads();
+  threads = min(threads, max<size_t>(1, (end - body) / (1 << 20)));
+
+  vector<const char*> bounds{body};
+  for (size_t i = 1; i < threads; ++i) {
+    const char* cut = body + (end - body) * i / threads;
+    cut = max(cut, bounds.back());
+    bounds.push_back(min(end, end_of_line(cut, end) + 1));
+  }
+  bounds.push_back(end);
+
+  vector<size_t> first_row(bounds.size(), 0);
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    size_t rows = 0;
+    for (const char* p = bounds[i]; p < bounds[i+1];) {
+      const char* eol = end_of_line(p, bounds[i+1]);
+      if (eol > p && !(eol - p == 1 && *p == '\r')) ++rows;
+      p = eol + 1;
+    }
+    first_row[i+1] = first_row[i] + rows;
+  }
+  table.rows = first_row.back();
+  table.columns.resize(table.names.size());
+  for (Column& c : table.columns) c.resize(table.rows);
+
+  vector<exception_ptr> failures(threads);
+  vector<thread> workers;
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back([&, i] {
+      pin_worker(i);
+      try { parse_csv_rows(bounds[i], bounds[i+1], first_row[i], target.size(), target, table); }
+      catch (...) { failures[i] = current_exception(); }
+    });
+  for (thread& w : workers) w.join();
+  for (const exception_ptr& f : failures)
+    if (f) rethrow_exception(f);
+
+  return table;
+}
+
+Column_table read_csv(const string& filename, const set<string>& wanted)
+{ return parse_csv(read_file(filename), filename, wanted); }
+
+// The header line of a CSV file and the rows of one of 'parts' equal byte
+// ranges of its body. Every cut moves forward to the start of a line, so
+// the parts cover each row exactly once.
+string read_csv_part(const string& filename, size_t part, size_t parts)
+{
+  ifstream in(filename, ios::binary);
+  if (!in) error("Could not open ",filename);
+  string header;
+  if (!getline(in, header)) error("csv: missing header in ", filename);
+  streamoff body = in.tellg();
+  in.seekg(0, ios::end);
+  streamoff size = in.tellg();
+  if (body < 0 || size < 0) error("eval: worker processes need a regular file, not ", filename);
+
+  auto cut = [&](size_t k) -> streamoff {
+    if (k == 0) return body;
+    if (k == parts) return size;
+    in.clear();
+    in.seekg(body + (size - body) * streamoff(k) / streamoff(parts) - 1);
+    string rest;
+    getline(in, rest);
+    return (in && !in.eof()) ? streamoff(in.tellg()) : size;
+  };
+  streamoff first = cut(part), last = cut(part + 1);
+
+  string text = header + '\n';
+  size_t offset = text.size();
+  text.resize(offset + size_t(last - first));
+  in.clear();
+  in.seekg(first);
+  in.read(&text[offset], last - first);
+  if (in.gcount() != last - first) error("eval: could not read ", filename);
+  return text;
+}
+
+void load_table(const string& name, const string& filename)
+{
+  string header;
+  ifstream in(filename);
+  if (!in || !getline(in, header)) error("load table: Could not open ",filename);
+  set<string> wanted;
+  istringstream fields(header);
+  vector<string> columns;
+  for (string column; columns.size() < 2 && getline(fields, column, ',');) {
+    column.erase(0, column.find_first_not_of(' '));
+    column.erase(column.find_last_not_of(" \r") + 1);
+    columns.push_back(column);
+  }
+  if (columns.size() < 2 || columns[0] == columns[1]) error("load table: expected key and value columns in ",filename);
+
+  Column_table data = read_csv(filename, {columns[0], columns[1]});
+  if (data.rows == 0) error("load table: no rows in ",filename);
+  const Column& keys = data.columns[data.names[0] == columns[0] ? 0 : 1];
+  const Column& values = data.columns[data.names[0] == columns[0] ? 1 : 0];
+
+  vector<size_t> order(data.rows);
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+  Table t;
+  bool integral = true;
+  for (size_t i : order) {
+    if (!t.keys.empty() && t.keys.back() == keys[i]) error("load table: duplicate key in ",filename);
+    if (keys[i] != floor(keys[i])) integral = false;
+    t.keys.push_back(keys[i]);
+    t.values.push_back(values[i]);
+  }
+  double range = t.keys.back() - t.keys[0];
+  if (integral && range < 2.0 * t.keys.size() + 64) {
+    t.direct.assign(size_t(range) + 1, no_entry);
+    for (size_t i = 0; i < t.keys.size(); ++i) t.direct[size_t(t.keys[i] - t.keys[0])] = i;
+  }
+
+  size_t n = t.keys.size();
+  t.curvature.assign(n, 0);
+  vector<double> diagonal(n, 1), rhs(n, 0);
+  for (size_t i = 1; i + 1 < n; ++i) {
+    double h0 = t.keys[i] - t.keys[i-1], h1 = t.keys[i+1] - t.keys[i];
+    double lower = (i > 1) ? h0 / diagonal[i-1] : 0;
+    diagonal[i] = 2 * (h0 + h1) - lower * h0;
+    rhs[i] = 6 * ((t.values[i+1] - t.values[i]) / h1 - (t.values[i] - t.values[i-1]) / h0) - lower * rhs[i-1];
+  }
+  for (size_t i = n - 1; i-- > 1;)
+    t.curvature[i] = (rhs[i] - (t.keys[i+1] - t.keys[i]) * t.curvature[i+1]) / diagonal[i];
+
+  tables[name] = move(t);
+  ++env_generation;
+  cout << "\nTable " << name << " loaded from " << filename << " (" << data.rows << " keys, "
+       << (tables[name].direct.empty() ? "sorted index" : "direct index") << ").\n\n";
+}
+
+const size_t output_block = 16384;
+
+void format_block(const double* first, const double* last, string& text)
+{
+  char buffer[400];
+  text.clear();
+  for (; first != last; ++first) {
+    auto r = to_chars(buffer, buffer + sizeof buffer - 1, *first, chars_format::fixed, current_precision);
+    *r.ptr++ = '\n';
+    text.append(buffer, r.ptr);
+  }
+}
+
+void write_column(const vector<double>& values)
+{
+  size_t threads = max(1u, thread::hardware_concurrency());
+  vector<string> blocks(threads);
+  const double* data = values.data();
+  size_t n = values.size();
+
+  for (size_t start = 0; start < n; start += threads * output_block) {
+    auto block = [&](size_t i) {
+      size_t first = min(n, start + i * output_block);
+      size_t last = min(n, first + output_block);
+      format_block(data + first, data + last, blocks[i]);
+    };
+    vector<thread> workers;
+    for (size_t i = 1; i < threads && start + i * output_block < n; ++i) workers.emplace_back([&, i] { pin_worker(i); block(i); });
+    block(0);
+    for (thread& w : workers) w.join();
+
+    for (size_t i = 0; i <= workers.size(); ++i) cout.write(blocks[i].data(), blocks[i].size());
+  }
+}
+
+struct Partial
+{
+  double sum;
+  double min;
+  double max;
+  size_t count;
+
+  Partial() : sum(0), min(HUGE_VAL), max(-HUGE_VAL), count(0) {}
+
+  void add(const double* v, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i) {
+      sum += v[i];
+      min = std::min(min, v[i]);
+      max = std::max(max, v[i]);
+    }
+    count += n;
+  }
+
+  void merge(const Partial& p)
+  {
+    sum += p.sum;
+    min = std::min(min, p.min);
+    max = std::max(max, p.max);
+    count += p.count;
+  }
+};
 
-  if (getline(in, line)) {
-    istringstream header(line);
-    string label, eq;
-    int file_precision;
-    header >> label >> eq >> file_precision;
+const set<string> aggregates = {"sum", "mean", "min", "max"};
+const size_t shard_block = 4096;
+size_t worker_processes = 0;
 
-    cout << "\nThe file specifies a precision of " << file_precision << " digits.";
-    cout << "\nDo you want to apply this precision to future outputs?";
-    cout << "\n\n 1. Yes";
-    cout << "\n 2. No";
-    cout << "\n\nSelect option (1-2): ";
+Partial aggregate_columns(const Code& code, const vector<const double*>& columns, size_t rows)
+{
+  Native_formula* formula = native_formula(code);
+  size_t shards = max<size_t>(1, min(worker_threads(), rows / shard_block));
+  vector<Partial> partials(shards);
+  vector<string> failures(shards);
+  auto work = [&](size_t s) {
+    try {
+      vector<double> out(shard_block);
+      vector<const double*> shifted(columns.size());
+      size_t first = rows * s / shards, last = rows * (s + 1) / shards;
+      for (size_t start = first; start < last; start += shard_block) {
+        size_t m = min(shard_block, last - start);
+        for (size_t c = 0; c < columns.size(); ++c) shifted[c] = columns[c] + start;
+        evaluate_columns(code, formula, shifted, m, out.data());
+        partials[s].add(out.data(), m);
+      }
+    }
+    catch (exception& e) { failures[s] = e.what(); }
+  };
 
-    int option;
-    bool loop = true;
-    while (loop) {
-      cin.clear();
-      cin.ignore(numeric_limits<streamsize>::max(), '\n');
+  vector<thread> workers;
+  for (size_t s = 1; s < shards; ++s) workers.emplace_back([&, s] { pin_worker(s); work(s); });
+  work(0);
+  for (thread& w : workers) w.join();
+  for (const string& e : failures)
+    if (!e.empty()) error(e);
 
-      cin >> option;
+  Partial total;
+  for (const Partial& p : partials) total.merge(p);
+  return total;
+}
 
-      switch(option){
-        case 1:
-          set_precision(file_precision);
-          cout << "\nPrecision set to " << current_precision << " digits.\n";
-          loop = false;
-          break;
-        case 2:
-          cout << "\nKeeping current precision of " << current_precision << " digits.\n";
-          loop = false;
-          break;
-        default:
-          cout << "\nInvalid option. Please select 1 or 2: ";
-          break;
+void bind_columns(Code& code, const Column_table& table)
+{
+  for (Instruction& in : code) {
+    if (in.kind!=Instruction::id::load) continue;
+    auto p = find(table.names.begin(), table.names.end(), in.name);
+    if (p == table.names.end()) in = Instruction(get_value(in.name));
+    else {
+      in.kind = Instruction::id::load_column;
+      in.column = p - table.names.begin();
+    }
+  }
+}
+
+// With -W n, an aggregate is computed by n forked worker processes. Each
+// one reads and parses its own byte range of the file, reduces it with
+// aggregate_columns(), and answers over a socket with a single record:
+// 1 followed by sum, min, max and count, 0 followed by an error message,
+// or 2 followed by a row error with the row counted within its part.
+Partial aggregate_processes(const Code& code, const string& filename, const set<string>& used)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  vector<int> sockets;
+  vector<pid_t> pids;
+  string failure;
+  for (size_t k = 0; k < worker_processes; ++k) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) { failure = "eval: could not create a worker socket"; break; }
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      failure = "eval: could not start a worker process";
+      break;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      for (int fd : sockets) close(fd);
+      process_index = k;
+      process_count = worker_processes;
+      ostringstream reply;
+      try {
+        Column_table table = parse_csv(read_csv_part(filename, k, worker_processes), filename, used);
+        Code bound = code;
+        bind_columns(bound, table);
+        vector<const double*> columns;
+        for (const Column& c : table.columns) columns.push_back(c.data());
+        Partial p = aggregate_columns(bound, columns, table.rows);
+        write_raw<unsigned char>(reply, 1);
+        write_raw(reply, p.sum);
+        write_raw(reply, p.min);
+        write_raw(reply, p.max);
+        write_raw<unsigned long long>(reply, p.count);
+      }
+      catch (Row_error& e) {
+        reply.str("");
+        write_raw<unsigned char>(reply, 2);
+        write_string(reply, e.before);
+        write_raw<unsigned long long>(reply, e.row);
+        write_string(reply, e.after);
       }
+      catch (exception& e) {
+        reply.str("");
+        write_raw<unsigned char>(reply, 0);
+        write_string(reply, e.what());
+      }
+      string message = reply.str();
+      for (size_t sent = 0; sent < message.size();) {
+        ssize_t n = write(fds[1], message.data() + sent, message.size() - sent);
+        if (n > 0) sent += n;
+        else if (errno != EINTR) break;
+      }
+      _exit(0);
     }
+    close(fds[1]);
+    sockets.push_back(fds[0]);
+    pids.push_back(pid);
   }
 
-  while (getline(in, line)){
-    istringstream stream(line);
-    string name, eq, is_const_str;
-    double value;
-    int is_const;
+  Partial total;
+  for (size_t k = 0; k < sockets.size(); ++k) {
+    string message;
+    char buffer[256];
+    for (ssize_t n; (n = read(sockets[k], buffer, sizeof buffer)) != 0;) {
+      if (n > 0) message.append(buffer, n);
+      else if (errno != EINTR) break;
+    }
+    close(sockets[k]);
+    while (waitpid(pids[k], nullptr, 0) < 0 && errno == EINTR) ;
+    try {
+      if (message.empty()) error("eval: worker process ", to_string(k + 1) + " exited without a result");
+      Reader in(message);
+      string worker = "eval: worker process " + to_string(k + 1) + " of " + to_string(sockets.size()) + ": ";
+      auto tag = in.get<unsigned char>();
+      if (tag == 0) error(worker, in.get_string());
+      if (tag == 2) {
+        // Every earlier worker succeeded, or its failure would be the one
+        // reported, so the merged count is the number of rows before this part.
+        string before = in.get_string();
+        auto row = in.get<unsigned long long>();
+        error(worker, before + to_string(total.count + row) + in.get_string());
+      }
+      Partial p;
+      p.sum = in.get<double>();
+      p.min = in.get<double>();
+      p.max = in.get<double>();
+      p.count = in.get<unsigned long long>();
+      total.merge(p);
+    }
+    catch (runtime_error& e) {
+      if (failure.empty()) failure = e.what();
+    }
+  }
+  if (!failure.empty()) error(failure);
+  return total;
+#else
+  error("eval: worker processes are not available on this platform");
+#endif
+}
 
-    stream >> name >> eq >> value >> is_const_str >> eq >> is_const;
+void eval_over()
+{
+  string aggregate;
+  Token t = ts.get();
+  if (t.kind==Token::id::name_token && aggregates.count(t.name)) {
+    Token tt = ts.get();
+    if (tt.is_symbol('(')) aggregate = t.name;
+    else { ts.unget(tt); ts.unget(t); }
+  }
+  else ts.unget(t);
 
-    if (name.empty()) continue;
+  Code code;
+  expression(code);
+  if (!aggregate.empty() && !ts.get().is_symbol(')')) error("')' expected");
+  t = ts.get();
+  if (!t.is_name("over")) error("Expected 'over' after expression in eval");
+  string filename = read_filename(".csv");
 
-    if (!is_declared(name)){
-      define_name(name, value, is_const);
-      cout << "\nLoaded variable : " << name << " = " << value << "\n(const: " << (is_const ? "yes" : "no") << ")\n";
+  set<string> used;
+  for (const Instruction& in : code)
+    if (in.kind==Instruction::id::load) used.insert(in.name);
+
+  Partial total;
+  if (!aggregate.empty() && worker_processes > 0) total = aggregate_processes(code, filename, used);
+  else {
+    Column_table table = read_csv(filename, used);
+    bind_columns(code, table);
+    vector<const double*> columns;
+    for (const Column& c : table.columns) columns.push_back(c.data());
+    if (aggregate.empty()) {
+      vector<double> results(table.rows);
+      evaluate_columns(code, native_formula(code), columns, table.rows, results.data());
+      write_column(results);
+      return;
     }
-    else{
-      cout << "\nConflict detected for variable: " << name << "." << endl;
-      cout << "\nExisting value: " << get_value(name) << "\n(const: " << (is_constant(name) ? "yes" : "no") << ")\n";
-      cout << "\nFile value: " << value << "\n(const: " << (is_const ? "yes" : "no") << ")\n";
+    total = aggregate_columns(code, columns, table.rows);
+  }
+  if (total.count == 0) error("eval: no rows in ",filename);
+  cout.setf(ios::fixed);
+  cout.precision(current_precision);
+  cout << result << (aggregate == "sum" ? total.sum : aggregate == "mean" ? total.sum / total.count :
+                     aggregate == "min" ? total.min : total.max) << '\n';
+}
 
-      cout << "\nChoose an action:\n";
-      cout << "  \n1. Keep existing value\n";
-      cout << "  \n2. Overwrite with file value\n";
-      cout << "\n\nSelect option (1-2): ";
+struct Fit_problem
+{
+  Code code;
+  vector<vector<size_t>> slots;   // instructions that read each parameter
+  vector<const double*> columns;
+  const double* y;
+  size_t rows;
+};
 
-      int option;
-      bool loop = true;
+const size_t fit_block = 4096;
 
-      while (loop){
-        cin.clear();
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+double fit_pass(const Fit_problem& f, const vector<double>& p, bool jacobian, vector<double>& jtj, vector<double>& jtr)
+{
+  size_t np = p.size();
+  size_t threads = max(1u, thread::hardware_concurrency());
+  threads = max<size_t>(1, min(threads, f.rows / fit_block));
+  vector<double> step(np);
+  for (size_t j = 0; j < np; ++j) step[j] = 1.5e-8 * max(fabs(p[j]), 1.0);
 
-        cin >> option;
+  vector<double> costs(threads, 0);
+  vector<vector<double>> local_jtj(threads, vector<double>(np * np, 0));
+  vector<vector<double>> local_jtr(threads, vector<double>(np, 0));
+  vector<string> failures(threads);
+  auto work = [&](size_t t) {
+    try {
+      Code code = f.code;
+      auto patch = [&](size_t j, double v) { for (size_t k : f.slots[j]) code[k].value = v; };
+      for (size_t j = 0; j < np; ++j) patch(j, p[j]);
+      vector<double> base(fit_block), r(fit_block), jac(np * fit_block);
+      vector<const double*> columns(f.columns.size());
+      size_t first = f.rows * t / threads, last = f.rows * (t + 1) / threads;
 
-        switch (option){
-          case 1:
-            cout << "\nKeeping existing value for '" << name << "'.\n";
-            loop = false;
-            break;
-          case 2:
-            names[name] = Value(name, value, is_const);
-            cout << "\nOverwritten '" << name << "' with value from file.\n";
-            loop = false;
-            break;
-          default:
-            cout << "\nInvalid option. Please select 1, or 2: ";
-            break;
+      for (size_t start = first; start < last; start += fit_block) {
+        size_t m = min(fit_block, last - start);
+        for (size_t c = 0; c < columns.size(); ++c) columns[c] = f.columns[c] + start;
+        run_columns(code, columns, m, base.data());
+        for (size_t i = 0; i < m; ++i) {
+          r[i] = base[i] - f.y[start + i];
+          costs[t] += r[i] * r[i];
+        }
+        if (!jacobian) continue;
+
+        for (size_t j = 0; j < np; ++j) {
+          double* d = jac.data() + j * fit_block;
+          patch(j, p[j] + step[j]);
+          run_columns(code, columns, m, d);
+          patch(j, p[j]);
+          for (size_t i = 0; i < m; ++i) d[i] = (d[i] - base[i]) / step[j];
+        }
+        for (size_t a = 0; a < np; ++a) {
+          const double* da = jac.data() + a * fit_block;
+          for (size_t b = 0; b <= a; ++b) {
+            const double* db = jac.data() + b * fit_block;
+            double sum = 0;
+            for (size_t i = 0; i < m; ++i) sum += da[i] * db[i];
+            local_jtj[t][a * np + b] += sum;
+          }
+          double sum = 0;
+          for (size_t i = 0; i < m; ++i) sum += da[i] * r[i];
+          local_jtr[t][a] += sum;
+        }
+      }
+    }
+    catch (exception& e) { failures[t] = e.what(); }
+  };
+
+  vector<thread> workers;
+  for (size_t t = 1; t < threads; ++t) workers.emplace_back([&, t] { pin_worker(t); work(t); });
+  work(0);
+  for (thread& w : workers) w.join();
+  for (const string& e : failures)
+    if (!e.empty()) error(e);
+
+  double cost = 0;
+  jtj.assign(np * np, 0);
+  jtr.assign(np, 0);
+  for (size_t t = 0; t < threads; ++t) {
+    cost += costs[t];
+    for (size_t a = 0; a < np; ++a) {
+      jtr[a] += local_jtr[t][a];
+      for (size_t b = 0; b <= a; ++b) jtj[a * np + b] += local_jtj[t][a * np + b];
+    }
+  }
+  for (size_t a = 0; a < np; ++a)
+    for (size_t b = 0; b < a; ++b) jtj[b * np + a] = jtj[a * np + b];
+  return isnan(cost) ? HUGE_VAL : cost;
+}
+
+bool solve(vector<double> a, vector<double>& x)
+{
+  size_t n = x.size();
+  for (size_t c = 0; c < n; ++c) {
+    size_t pivot = c;
+    for (size_t r = c + 1; r < n; ++r)
+      if (fabs(a[r * n + c]) > fabs(a[pivot * n + c])) pivot = r;
+    if (!(fabs(a[pivot * n + c]) > 0)) return false;
+    for (size_t k = 0; k < n; ++k) swap(a[c * n + k], a[pivot * n + k]);
+    swap(x[c], x[pivot]);
+    for (size_t r = c + 1; r < n; ++r) {
+      double f = a[r * n + c] / a[c * n + c];
+      for (size_t k = c; k < n; ++k) a[r * n + k] -= f * a[c * n + k];
+      x[r] -= f * x[c];
+    }
+  }
+  for (size_t c = n; c-- > 0;) {
+    for (size_t k = c + 1; k < n; ++k) x[c] -= a[c * n + k] * x[k];
+    x[c] /= a[c * n + c];
+  }
+  return true;
+}
+
+void fit_over()
+{
+  Fit_problem f;
+  expression(f.code);
+  Token t = ts.get();
+  if (!t.is_name("to")) error("Expected 'to' after expression in fit");
+  Token y = ts.get();
+  if (y.kind != Token::id::name_token) error("Expected a column name after 'to'");
+  t = ts.get();
+  if (!t.is_name("varying")) error("Expected 'varying' after the column name in fit");
+
+  vector<string> parameters;
+  do {
+    t = ts.get();
+    if (t.kind != Token::id::name_token) error("Expected a parameter name after 'varying'");
+    if (is_constant(t.name)) error(t.name," constant cannot be modified");
+    parameters.push_back(t.name);
+    t = ts.get();
+  } while (t.is_symbol(','));
+  if (!t.is_name("over")) error("Expected 'over' after the parameters in fit");
+  string filename = read_filename(".csv");
+
+  set<string> used{y.name};
+  f.slots.resize(parameters.size());
+  for (size_t i = 0; i < f.code.size(); ++i) {
+    Instruction& in = f.code[i];
+    if (in.kind!=Instruction::id::load) continue;
+    auto p = find(parameters.begin(), parameters.end(), in.name);
+    if (p == parameters.end()) used.insert(in.name);
+    else f.slots[p - parameters.begin()].push_back(i);
+  }
+  for (size_t j = 0; j < parameters.size(); ++j)
+    if (f.slots[j].empty()) error("fit: the expression does not use ",parameters[j]);
+
+  Column_table table = read_csv(filename, used);
+  if (table.rows == 0) error("fit: no rows in ",filename);
+  for (Instruction& in : f.code) {
+    if (in.kind!=Instruction::id::load) continue;
+    auto p = find(table.names.begin(), table.names.end(), in.name);
+    if (find(parameters.begin(), parameters.end(), in.name) != parameters.end()) in = Instruction(0.0);
+    else if (p == table.names.end()) in = Instruction(get_value(in.name));
+    else {
+      in.kind = Instruction::id::load_column;
+      in.column = p - table.names.begin();
+    }
+  }
+  auto ycol = find(table.names.begin(), table.names.end(), y.name);
+  if (ycol == table.names.end()) error("fit: no column ",y.name);
+  for (const Column& c : table.columns) f.columns.push_back(c.data());
+  f.y = f.columns[ycol - table.names.begin()];
+  f.rows = table.rows;
+
+  size_t np = parameters.size();
+  vector<double> p(np), jtj, jtr, trial_jtj, trial_jtr;
+  for (size_t j = 0; j < np; ++j) p[j] = is_declared(parameters[j]) ? get_value(parameters[j]) : 1;
+
+  auto start = chrono::steady_clock::now();
+  double cost = fit_pass(f, p, true, jtj, jtr);
+  if (cost == HUGE_VAL) error("fit: the expression is not finite at the starting values");
+  double lambda = 1e-3;
+  int iterations = 0;
+  bool converged = cost == 0;
+  for (; !converged && iterations < 200 && lambda < 1e16; ++iterations) {
+    vector<double> a = jtj, delta(np);
+    for (size_t j = 0; j < np; ++j) {
+      a[j * np + j] += lambda * max(jtj[j * np + j], 1e-12);
+      delta[j] = -jtr[j];
+    }
+    if (!solve(a, delta)) { lambda *= 10; continue; }
+    if (all_of(delta.begin(), delta.end(), [](double d) { return d == 0; })) { converged = true; break; }
+
+    vector<double> q = p;
+    for (size_t j = 0; j < np; ++j) q[j] += delta[j];
+    double trial;
+    try { trial = fit_pass(f, q, false, trial_jtj, trial_jtr); }
+    catch (runtime_error&) { trial = HUGE_VAL; }
+    if (!(trial < cost)) { lambda *= 10; continue; }
+
+    converged = cost - trial <= 1e-12 * cost;
+    p = q;
+    cost = fit_pass(f, p, true, jtj, jtr);
+    lambda = max(lambda / 10, 1e-12);
+    if (cost == 0) converged = true;
+  }
+  auto stop = chrono::steady_clock::now();
+  double ms = chrono::duration<double,milli>(stop - start).count();
+  if (!converged) {
+    ostringstream why;
+    why << "fit: did not converge after " << iterations << " iterations (residual sum of squares "
+        << cost << "); " << (np == 1 ? "the parameter was" : "the parameters were") << " not changed";
+    error(why.str());
+  }
+
+  for (size_t j = 0; j < np; ++j) {
+    if (is_declared(parameters[j])) set_value(parameters[j], p[j]);
+    else define_name(parameters[j], p[j]);
+  }
+  cout.setf(ios::fixed);
+  cout.precision(current_precision);
+  cout << "\nFitted " << table.rows << " rows in " << iterations << " iterations ("
+       << ms / max(iterations, 1) << " ms per iteration), residual sum of squares " << cost << ":\n";
+  for (size_t j = 0; j < np; ++j) cout << "  " << parameters[j] << " = " << p[j] << '\n';
+  cout << '\n';
+}
+
+void generate_cpp(const Statement& s)
+{
+  vector<string> parameters;
+  vector<string> stack;
+  ostringstream literal;
+  literal.precision(17);
+
+  for (const Instruction& in : s.code)
+  {
+    switch (in.kind)
+    {
+      case Instruction::id::literal:
+        literal.str("");
+        literal << in.value;
+        stack.push_back(literal.str());
+        break;
+      case Instruction::id::load:
+        if (is_constant(in.name)) {
+          literal.str("");
+          literal << get_value(in.name);
+          stack.push_back(literal.str());
+        }
+        else {
+          if (find(parameters.begin(), parameters.end(), in.name) == parameters.end())
+            parameters.push_back(in.name);
+          stack.push_back(in.name);
+        }
+        break;
+      case Instruction::id::negate:
+        stack.back() = "(-" + stack.back() + ")";
+        break;
+      case Instruction::id::call:
+        stack.back() = "std::" + (in.name == "ln" ? string("log") : in.name) + "(" + stack.back() + ")";
+        break;
+      case Instruction::id::lookup:
+      case Instruction::id::interp:
+      case Instruction::id::spline:
+        error("cpp: tables cannot be exported");
+        break;
+      default:
+      {
+        string right = stack.back();
+        stack.pop_back();
+        string& left = stack.back();
+        switch (in.kind)
+        {
+          case Instruction::id::add: left = "(" + left + " + " + right + ")"; break;
+          case Instruction::id::subtract: left = "(" + left + " - " + right + ")"; break;
+          case Instruction::id::multiply: left = "(" + left + " * " + right + ")"; break;
+          case Instruction::id::divide: left = "(" + left + " / " + right + ")"; break;
+          case Instruction::id::modulo: left = "std::fmod(" + left + ", " + right + ")"; break;
+          case Instruction::id::power: left = "std::pow(" + left + ", " + right + ")"; break;
+          default: error("cpp: bad instruction");
         }
       }
     }
   }
 
-  in.close();
-  cout << "\nEnvironment loaded from " << filename << ".\n\n";
+  cout << "\n#include <cmath>\n\ninline double " << (s.name.empty() ? string("formula") : s.name) << "(";
+  for (size_t i = 0; i < parameters.size(); ++i)
+    cout << (i ? ", " : "") << "double " << parameters[i];
+  cout << ")\n{\n  return " << stack.back() << ";\n}\n\n";
+}
+
+struct Compiled
+{
+  string key;
+  Statement statement;
+  Statement optimized;
+  int tier;
+  unsigned long runs;
+  unsigned long generation;
+  vector<pair<const Value*,unsigned long>> folded;
+  bool memo_valid;
+  unsigned long memo_generation;
+  double memo;
+  vector<pair<const Value*,unsigned long>> inputs;
+
+  Compiled(const string& k, const Statement& s)
+  : key(k), statement(s), optimized(s), tier(0), runs(0), generation(0), folded(),
+    memo_valid(false), memo_generation(0), memo(0), inputs()
+  {}
+};
+
+const size_t max_compiled = 4096;
+list<Compiled> compiled;
+unordered_map<string,list<Compiled>::iterator> compiled_index;
+unsigned long cache_hits = 0;
+unsigned long cache_misses = 0;
+unsigned long tier_threshold = 8;
+unsigned long tier_runs[2] = {0, 0};
+unsigned long promotions = 0;
+unsigned long demotions = 0;
+unsigned long memo_hits = 0;
+
+Code optimize_code(const Code& code, map<string,double>& known)
+{
+  for (const Instruction& in : code)
+    if (in.kind==Instruction::id::load && is_constant(in.name)) known[in.name] = get_value(in.name);
+  return fold(code, known);
+}
+
+void bind_slots(Code& code)
+{
+  for (Instruction& in : code)
+    if (in.kind==Instruction::id::load && is_declared(in.name)) {
+      in.kind = Instruction::id::load_slot;
+      in.slot = &names[in.name];
+    }
+    else if (uses_table(in) && tables.count(in.name))
+      in.table = &tables[in.name];
+}
+
+void promote(Compiled& c)
+{
+  map<string,double> known;
+  c.optimized = c.statement;
+  c.optimized.code = optimize_code(c.statement.code, known);
+  bind_slots(c.optimized.code);
+  c.folded.clear();
+  for (const auto& [name, value] : known) {
+    const Value& v = names[name];
+    c.folded.push_back({&v, v.version});
+  }
+  c.tier = 1;
+  c.generation = env_generation;
+  ++promotions;
+}
+
+string token_key(const vector<Token>& tokens)
+{
+  string key;
+  for (const Token& t : tokens) {
+    key += static_cast<char>(t.kind);
+    if (t.kind==Token::id::char_token) key += t.symbol;
+    else if (t.kind==Token::id::number) key.append(reinterpret_cast<const char*>(&t.value), sizeof t.value);
+    else if (t.kind==Token::id::name_token || t.kind==Token::id::function_token) key += t.name + ' ';
+  }
+  return key;
+}
+
+double execute_tiered(Compiled& c)
+{
+  bool stale = c.generation != env_generation;
+  for (const auto& [slot, version] : c.folded)
+    if (stale || slot->version != version) { stale = true; break; }
+  if (c.tier == 1 && stale) { c.tier = 0; ++demotions; }
+  if (c.tier == 0 && ++c.runs > tier_threshold) promote(c);
+  const Statement& s = (c.tier == 1 ? c.optimized : c.statement);
+  check_store(s);
+
+  bool unchanged = c.memo_valid && c.memo_generation == env_generation;
+  for (const auto& [slot, version] : c.inputs)
+    if (!unchanged || slot->version != version) { unchanged = false; break; }
+  if (unchanged) {
+    ++memo_hits;
+    return store(s, c.memo);
+  }
+
+  ++tier_runs[c.tier];
+  c.memo_valid = false;
+  c.memo = run(s.code);
+  c.inputs.clear();
+  for (const Instruction& in : c.statement.code)
+    if (in.kind==Instruction::id::load) {
+      const Value* slot = &names.find(in.name)->second;
+      c.inputs.push_back({slot, slot->version});
+    }
+  c.memo_valid = true;
+  c.memo_generation = env_generation;
+  return store(s, c.memo);
+}
+
+vector<Token> read_statement(Token first)
+{
+  vector<Token> tokens{first};
+  while (tokens.back().kind!=Token::id::print && tokens.back().kind!=Token::id::quit)
+    tokens.push_back(ts.get());
+  return tokens;
+}
+
+double execute_cached(Token first)
+{
+  vector<Token> tokens = read_statement(first);
+  string key = token_key(tokens);
+
+  auto p = compiled_index.find(key);
+  if (p != compiled_index.end()) {
+    ++cache_hits;
+    compiled.splice(compiled.begin(), compiled, p->second);
+    ts.unget(tokens.back());
+    return execute_tiered(compiled.front());
+  }
+
+  ++cache_misses;
+  for (auto t = tokens.rbegin(); t != tokens.rend(); ++t) ts.unget(*t);
+  Statement s = compile();
+  if (ts.pending() != 1) { ++tier_runs[0]; return execute(s); }
+
+  compiled.emplace_front(key, s);
+  compiled_index[key] = compiled.begin();
+  if (compiled.size() > max_compiled) {
+    compiled_index.erase(compiled.back().key);
+    compiled.pop_back();
+  }
+  return execute_tiered(compiled.front());
+}
+
+void set_tier()
+{
+  Token t = ts.get();
+  if (t.kind != Token::id::number || t.value < 0)
+    error("Expected a number of runs after 'set tier'");
+  tier_threshold = static_cast<unsigned long>(t.value);
+  cout << "Statements are promoted after " << tier_threshold << " runs." << endl;
+}
+
+struct Queue_counters
+{
+  unsigned long long admitted;
+  unsigned long long rejected;
+  double wait;        // seconds admitted calls spent queued
+  double max_wait;
+
+  Queue_counters() : admitted(0), rejected(0), wait(0), max_wait(0) {}
+
+  void add(double w)
+  {
+    ++admitted;
+    wait += w;
+    max_wait = max(max_wait, w);
+  }
+};
+
+mutex schedule_lock;           // guards the C interface queues and their counters
+Queue_counters queue_totals;
+
+void show_stats()
+{
+  Queue_counters queue;
+  { lock_guard<mutex> lock(schedule_lock); queue = queue_totals; }
+  cout << "\nCached statements: " << compiled.size() << " of " << max_compiled
+       << "\nCache hits: " << cache_hits
+       << "\nCache misses: " << cache_misses
+       << "\nTier threshold: " << tier_threshold << " runs"
+       << "\nTier 0 (interpreted) runs: " << tier_runs[0]
+       << "\nTier 1 (optimized) runs: " << tier_runs[1]
+       << "\nPromotions: " << promotions
+       << "\nDemotions: " << demotions
+       << "\nReused results (inputs unchanged): " << memo_hits
+       << "\nWorker threads: " << max(1u, thread::hardware_concurrency())
+       << (pin_threads ? " (pinned to cores)" : " (not pinned)")
+       << "\nWorker processes: " << (worker_processes ? to_string(worker_processes) + " for aggregates" : string("off (-W n)"))
+#ifdef MADV_HUGEPAGE
+       << "\nHuge pages: advised for columns of 2 MB or more (" << (huge_page_bytes >> 20) << " MB so far)"
+#else
+       << "\nHuge pages: not available on this platform"
+#endif
+       << "\nNative formulas: " << (native ? "on" : "off (-N)") << ", " << native_builds << " built, "
+       << native_loads << " loaded, " << native_fallbacks << " interpreted instead"
+       << "\nC interface queues: " << queue.admitted << " calls admitted, " << queue.rejected << " rejected, wait "
+       << llround(queue.admitted ? queue.wait / queue.admitted * 1e6 : 0) << " us mean, " << llround(queue.max_wait * 1e6) << " us max"
+       << "\nWatched env: " << (watched_env.empty() ? string("(none)") : watched_env + " (" + to_string(env_reloads) + " reloads)")
+       << "\n\n";
+}
+
+const string instruction_names[] = {
+  "literal", "load", "load_slot", "load_column", "negate", "add", "subtract",
+  "multiply", "divide", "modulo", "call", "power", "lookup", "interp", "spline"
+};
+
+void print_code(const Code& code)
+{
+  for (size_t i = 0; i < code.size(); ++i) {
+    const Instruction& in = code[i];
+    cout << "  " << setw(4) << i << "  " << left << setw(10) << instruction_names[in.kind] << right;
+    if (in.kind==Instruction::id::literal) cout << in.value;
+    else cout << in.name;
+    cout << '\n';
+  }
+}
+
+unsigned long estimate_cost(const Code& code)
+{
+  unsigned long cost = 0;
+  for (const Instruction& in : code)
+    switch (in.kind)
+    {
+      case Instruction::id::load: cost += 10; break;
+      case Instruction::id::divide: cost += 4; break;
+      case Instruction::id::modulo: cost += 20; break;
+      case Instruction::id::call: cost += 20; break;
+      case Instruction::id::power: cost += 40; break;
+      case Instruction::id::lookup: cost += 15; break;
+      case Instruction::id::interp: cost += 20; break;
+      case Instruction::id::spline: cost += 30; break;
+      default: cost += 1;
+    }
+  return cost;
+}
+
+void explain()
+{
+  long repeat = 0;
+  Token t = ts.get();
+  if (t.is_name("analyze")) {
+    Token n = ts.get();
+    if (n.kind!=Token::id::number || n.value < 1) error("Expected a number of runs after 'explain analyze'");
+    repeat = static_cast<long>(n.value);
+    t = ts.get();
+  }
+  if (!starts_statement(t)) error("Expected a statement after 'explain'");
+
+  vector<Token> tokens = read_statement(t);
+  auto p = compiled_index.find(token_key(tokens));
+  for (auto r = tokens.rbegin(); r != tokens.rend(); ++r) ts.unget(*r);
+  Statement s = compile();
+
+  map<string,double> known;
+  Code optimized = optimize_code(s.code, known);
+  bind_slots(optimized);
+
+  cout << "\nCompiled code (" << s.code.size() << " instructions):\n";
+  print_code(s.code);
+  if (!known.empty()) {
+    cout << "\nFolded constants:";
+    for (const auto& [key, val] : known) cout << ' ' << key << " = " << val;
+    cout << '\n';
+  }
+  cout << "\nOptimized code (" << optimized.size() << " instructions):\n";
+  print_code(optimized);
+
+  cout << "\nTier: ";
+  if (p == compiled_index.end()) cout << "0 (not cached yet)";
+  else if (p->second->tier == 1) cout << "1 (optimized, " << p->second->runs << " runs)";
+  else cout << "0 (interpreted, " << p->second->runs << " of " << tier_threshold << " runs before promotion)";
+  cout << "\nColumn engine: " << column_block << "-row blocks, stack depth " << stack_depth(s.code)
+       << "\nEstimated cost: " << estimate_cost(s.code) << " operations per evaluation at tier 0, "
+       << estimate_cost(optimized) << " at tier 1\n";
+
+  if (repeat > 0) {
+    double d = 0;
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < repeat; ++i) d = run(optimized);
+    auto stop = chrono::steady_clock::now();
+    double ns = chrono::duration<double,nano>(stop - start).count();
+    cout << "Measured: " << repeat << " runs, " << ns / repeat << " ns per evaluation, result " << d << '\n';
+  }
+  cout << '\n';
+}
+
+struct Tape
+{
+  Code code;
+  vector<size_t> left;      // operand nodes of each instruction
+  vector<size_t> right;
+  vector<size_t> input;     // position in names for load instructions
+  vector<string> names;
+  vector<double> value;
+  vector<double> adjoint;
+  vector<double> gradient;
+};
+
+const size_t max_tapes = 256;
+map<string,Tape> tapes;
+
+void record_tape(Tape& tape)
+{
+  vector<size_t> stack;
+  size_t n = tape.code.size();
+  tape.left.assign(n, 0);
+  tape.right.assign(n, 0);
+  tape.input.assign(n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const Instruction& in = tape.code[i];
+    if (in.kind==Instruction::id::load || in.kind==Instruction::id::load_slot) {
+      auto p = find(tape.names.begin(), tape.names.end(), in.name);
+      tape.input[i] = p - tape.names.begin();
+      if (p == tape.names.end()) tape.names.push_back(in.name);
+    }
+    if (in.kind<=Instruction::id::load_column) { stack.push_back(i); continue; }
+    if (in.kind==Instruction::id::negate || in.kind==Instruction::id::call || uses_table(in)) {
+      tape.left[i] = stack.back();
+      stack.back() = i;
+      continue;
+    }
+    tape.right[i] = stack.back();
+    stack.pop_back();
+    tape.left[i] = stack.back();
+    stack.back() = i;
+  }
+  tape.gradient.assign(tape.names.size(), 0);
+}
+
+double derivative(const Instruction& in, double x, double y)
+{
+  if (in.kind==Instruction::id::lookup) return 0;
+  if (in.kind==Instruction::id::interp || in.kind==Instruction::id::spline) {
+    const Table& t = in.table ? *in.table : get_table(in.name);
+    if (!(x > t.keys[0]) || !(x < t.keys.back())) return 0;
+    size_t i = floor_index(t.keys, x);
+    double h = t.keys[i+1] - t.keys[i];
+    double slope = (t.values[i+1] - t.values[i]) / h;
+    if (in.kind==Instruction::id::interp) return slope;
+    double b = (x - t.keys[i]) / h;
+    double a = 1 - b;
+    return slope + ((1 - 3*a*a) * t.curvature[i] + (3*b*b - 1) * t.curvature[i+1]) * h / 6;
+  }
+  if (in.name=="sin") return cos(x);
+  if (in.name=="cos") return -sin(x);
+  if (in.name=="tan") return 1 + y*y;
+  if (in.name=="asin") return 1 / sqrt(1 - x*x);
+  if (in.name=="acos") return -1 / sqrt(1 - x*x);
+  if (in.name=="atan") return 1 / (1 + x*x);
+  if (in.name=="exp") return y;
+  if (in.name=="ln") return 1 / x;
+  if (in.name=="log10") return 1 / (x * log(10.0));
+  if (in.name=="log2") return 1 / (x * log(2.0));
+  error("adjoint: no derivative for ",in.name);
+  return 0;
+}
+
+double run_tape(Tape& tape)
+{
+  size_t n = tape.code.size();
+  vector<double>& v = tape.value;
+  v.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const Instruction& in = tape.code[i];
+    double l = v[tape.left[i]], r = v[tape.right[i]];
+    switch (in.kind)
+    {
+      case Instruction::id::literal: v[i] = in.value; break;
+      case Instruction::id::load: v[i] = get_value(in.name); break;
+      case Instruction::id::load_slot: v[i] = in.slot->value; break;
+      case Instruction::id::negate: v[i] = -l; break;
+      case Instruction::id::call: v[i] = in.function(l); break;
+      case Instruction::id::add: v[i] = l + r; break;
+      case Instruction::id::subtract: v[i] = l - r; break;
+      case Instruction::id::multiply: v[i] = l * r; break;
+      case Instruction::id::divide:
+        if (r == 0) error("divide by zero");
+        v[i] = l / r;
+        break;
+      case Instruction::id::modulo:
+        if (r == 0) error("divide by zero");
+        v[i] = fmod(l,r);
+        break;
+      case Instruction::id::power: v[i] = pow(l,r); break;
+      default: v[i] = apply_table(in, l);
+    }
+  }
+
+  vector<double>& a = tape.adjoint;
+  a.assign(n, 0);
+  fill(tape.gradient.begin(), tape.gradient.end(), 0);
+  a[n-1] = 1;
+  for (size_t i = n; i-- > 0;) {
+    const Instruction& in = tape.code[i];
+    size_t l = tape.left[i], r = tape.right[i];
+    double d = a[i];
+    switch (in.kind)
+    {
+      case Instruction::id::literal: break;
+      case Instruction::id::load:
+      case Instruction::id::load_slot: tape.gradient[tape.input[i]] += d; break;
+      case Instruction::id::negate: a[l] -= d; break;
+      case Instruction::id::add: a[l] += d; a[r] += d; break;
+      case Instruction::id::subtract: a[l] += d; a[r] -= d; break;
+      case Instruction::id::multiply: a[l] += d * v[r]; a[r] += d * v[l]; break;
+      case Instruction::id::divide: a[l] += d / v[r]; a[r] -= d * v[i] / v[r]; break;
+      case Instruction::id::modulo: a[l] += d; a[r] -= d * trunc(v[l] / v[r]); break;
+      case Instruction::id::power:
+        if (v[r] != 0) a[l] += d * v[r] * pow(v[l], v[r] - 1);
+        if (v[l] > 0) a[r] += d * v[i] * log(v[l]);
+        break;
+      default: a[l] += d * derivative(in, v[l], v[i]);
+    }
+  }
+  return v[n-1];
 }
 
-string read_filename()
+void adjoint()
 {
-  char ch;
-  string filename = "";
+  Token t = ts.get();
+  if (!starts_statement(t)) error("Expected an expression after 'adjoint'");
+  vector<Token> tokens = read_statement(t);
+  string key = token_key(tokens);
 
-  cin >> ws;
-  while (cin.get(ch) && ch != ';'){
-    filename += ch;
+  // Like execute_cached, a statement that leaves tokens behind is run
+  // without being cached, and the leftovers stay in the stream.
+  Tape uncached;
+  auto p = tapes.find(key);
+  if (p == tapes.end()) {
+    for (auto r = tokens.rbegin(); r != tokens.rend(); ++r) ts.unget(*r);
+    Statement s = compile();
+    if (s.kind != Statement::id::expression) error("adjoint: expected an expression");
+    uncached.code = s.code;
+    bind_slots(uncached.code);
+    record_tape(uncached);
+    if (ts.pending() == 1) {
+      if (tapes.size() >= max_tapes) tapes.clear();
+      p = tapes.emplace(key, move(uncached)).first;
+    }
   }
-  cin.unget();
-
-  if (filename.empty()) error("Filename expected");
-
-  if (filename.size() < 4 || filename.substr(filename.size() - 4) != ".txt") error("\nFilename must end with .txt\n");
+  else ts.unget(tokens.back());
 
-  return filename;
+  Tape& tape = (p == tapes.end()) ? uncached : p->second;
+  double d = run_tape(tape);
+  cout.setf(ios::fixed);
+  cout.precision(current_precision);
+  cout << result << d << '\n';
+  for (size_t i = 0; i < tape.names.size(); ++i)
+    cout << "  d/d" << tape.names[i] << " = " << tape.gradient[i] << '\n';
 }
 
 double statement()
@@ -677,8 +3332,6 @@ double statement()
   Token t=ts.get();
   switch(t.kind)
   {
-    case Token::id::const_token:
-      return constant_assign();
     case Token::id::show_env_token:
       {
         Token next = ts.get();
@@ -689,7 +3342,11 @@ double statement()
     case Token::id::save_env_token:
       {
         Token next = ts.get();
-        if (next.name != "env") error("Expected 'env' after 'save'");
+        if (next.name == "image") {
+          save_image(read_filename(".img"));
+          return 0;
+        }
+        if (next.name != "env") error("Expected 'env' or 'image' after 'save'");
         string filename = read_filename();
         save_env(filename);
         return 0;
@@ -697,19 +3354,35 @@ double statement()
     case Token::id::load_env_token:
       {      
         Token next = ts.get();
-        if (next.name != "env") error("Expected 'env' after 'load'");
+        if (next.name == "image") {
+          load_image(read_filename(".img"));
+          return 0;
+        }
+        if (next.name == "table") {
+          Token name = ts.get();
+          if (name.kind != Token::id::name_token) error("Expected a table name after 'load table'");
+          load_table(name.name, read_filename(".csv"));
+          return 0;
+        }
+        if (next.name != "env") error("Expected 'env', 'image' or 'table' after 'load'");
         string filename = read_filename();
         load_env(filename);
         return 0;
       }
-    case Token::id::name_token:
+    case Token::id::watch_env_token:
       {
-        Token tt=ts.get();
-        if(tt.is_symbol('=')) { ts.unget(t); ts.unget(tt); return assign(); }
-        else { ts.unget(t); ts.unget(tt); return expression(); }
+        Token next = ts.get();
+        if (next.name != "env") error("Expected 'env' after 'watch'");
+        watch_env(read_filename());
+        return 0;
+      }
+    case Token::id::cpp_token:
+      {
+        generate_cpp(compile());
+        return 0;
       }
     default:
-      { ts.unget(t); return expression(); }
+      { return execute_cached(t); }
   }
 }
 
@@ -736,6 +3409,7 @@ void help()
     << "\n   - Inverse trig:  asin(x), acos(x), atan(x)"
     << "\n   - Exponential :  exp(x), pow(x, y)"
     << "\n   - Logarithmic :  ln(x), log10(x), log2(x)"
+    << "\n   - Tables      :  lookup(table, key), interp(table, x), spline(table, x)"
     << "\n"
     << "\n - Variables and Constants:"
     << "\n   - Assign a variable:     x = 42;"
@@ -745,48 +3419,795 @@ void help()
     << "\n   - show env;                  --> display current variables/constants"
     << "\n   - save env filename.txt;     --> save environment to file"
     << "\n   - load env filename.txt;     --> load environment from file"
+    << "\n   - save image session.img;    --> dump the whole session to a binary image"
+    << "\n   - load image session.img;    --> restore a session image without prompts"
+    << "\n   - load table t rates.csv;    --> load key,value rows as table t"
+    << "\n   - watch env filename.txt;    --> load it and reapply entries that change on disk"
+    << "\n"
+    << "\n - Column Evaluation:"
+    << "\n   - eval a*b + k over data.csv;  --> evaluate for every row, columns by header name"
+    << "\n   - eval mean(a*b) over data.csv;  --> also sum, min, max; rows are split across threads"
+    << "\n   - fit a*exp(k*t) to y varying a, k over data.csv;"
+    << "\n                                --> least-squares fit, stores the fitted parameters"
+    << "\n"
+    << "\n - Derivatives:"
+    << "\n   - adjoint a*sin(b) + c;      --> value and its gradient with respect to every name"
+    << "\n"
+    << "\n - Code Generation:"
+    << "\n   - cpp f = a*sin(b) + c;      --> print the formula as a C++ function"
     << "\n"
     << "\n - Precision Settings:"
     << "\n   - precision;                 --> show current display precision"
     << "\n   - set precision N;           --> set output precision (0-20 digits)"
     << "\n"
+    << "\n - Execution:"
+    << "\n   - stats;                     --> show statement cache and tier counters"
+    << "\n   - set tier N;                --> optimize a statement after N runs"
+    << "\n   - explain a*sin(b);          --> show compiled code, tier and cost estimate"
+    << "\n   - explain analyze N a*sin(b);--> also time N evaluations"
+    << "\n"
     << "\n Type 'help;' at any time to show this message again."
     << "\n\n";
 }
 
-const string prompt = "> ";
-const string result = "= ";
+
+bool interactive = true;
+bool optimize = false;
+
+void run_block(vector<Statement>& block)
+{
+  if (optimize) optimize_block(block);
+  cout.setf(ios::fixed);
+  cout.precision(current_precision);
+  for (const Statement& s : block)
+  try
+  {
+    double d = execute(s);
+    if (!optimize || s.kind==Statement::id::expression) cout<<result<<d<<'\n';
+  }
+  catch(runtime_error& e)
+  {
+    cerr<<e.what()<<endl;
+  }
+  block.clear();
+}
 
 void calculate()
 {
+  vector<Statement> block;
   while(true) 
   try 
   {
-    cout<<prompt;
+    if(interactive) cout<<prompt;
     Token t=ts.get();
     while (t.kind==Token::id::print) t=ts.get();
+    check_watched_env();
+    if (optimize && starts_statement(t)) { ts.unget(t); block.push_back(compile()); continue; }
+    run_block(block);
     if(t.kind==Token::id::quit) return;
     if(t.kind==Token::id::help_token) { help(); continue; }
     if (t.kind==Token::id::set_precision_token) { set_precision(); continue; }
     if (t.kind==Token::id::precision_token) { show_precision(); continue; }
+    if (t.kind==Token::id::set_tier_token) { set_tier(); continue; }
+    if (t.kind==Token::id::stats_token) { show_stats(); continue; }
+    if (t.kind==Token::id::explain_token) { explain(); continue; }
+    if (t.kind==Token::id::eval_token) { eval_over(); continue; }
+    if (t.kind==Token::id::adjoint_token) { adjoint(); continue; }
+    if (t.kind==Token::id::fit_token) { fit_over(); continue; }
     ts.unget(t);
     auto the_result=statement();
     cout.setf(ios::fixed);
     cout.precision(current_precision);
-    cout<<result<<the_result<<endl;
+    cout<<result<<the_result<<'\n';
   }
   catch(runtime_error& e) 
   {
+    run_block(block);
     cerr<<e.what()<< endl;
     clean_up_mess();
   }
 }
 
-int main()
+const string cache_magic = "CALCC";
+const unsigned int cache_version = 3;
+
+string cache_name(string filename)
+{
+  if (filename.size() >= 4 && filename.substr(filename.size() - 4) == ".txt")
+    filename.erase(filename.size() - 4);
+  return filename + ".calcc";
+}
+
+bool load_cache(string filename, unsigned long long hash, vector<Statement>& statements)
+{
+  ifstream probe(filename);
+  if (!probe) return false;
+  probe.close();
+
+  string data = read_file(filename);
+  Reader in(data);
+  if (data.compare(0, cache_magic.size(), cache_magic) != 0) return false;
+  in.pos = cache_magic.size();
+  if (in.get<unsigned int>() != cache_version) return false;
+  if (in.get<unsigned long long>() != hash) return false;
+
+  unsigned int n = in.get<unsigned int>();
+  if (n > in.left()) error("cache: truncated file");
+  statements.reserve(n);
+  for (unsigned int i = 0; i < n; ++i) {
+    unsigned char op = in.get<unsigned char>();
+    if (op > Statement::id::constant) error("cache: bad statement");
+    auto kind = static_cast<Statement::id>(op);
+    string name = in.get_string();
+    statements.push_back(Statement(kind, name, read_code(in)));
+  }
+  return true;
+}
+
+void compile_script(string filename)
+{
+  string text = read_file(filename);
+  istringstream script(text);
+  streambuf* console = cin.rdbuf(script.rdbuf());
+
+  vector<Statement> statements;
+  try {
+    while (true) {
+      Token t = ts.get();
+      while (t.kind==Token::id::print) t = ts.get();
+      if (t.kind==Token::id::quit) break;
+      if (!starts_statement(t)) error("compile: only statements can be compiled, not commands");
+      ts.unget(t);
+      statements.push_back(compile());
+    }
+  }
+  catch (runtime_error&) {
+    cin.rdbuf(console);
+    throw;
+  }
+  cin.rdbuf(console);
+
+  // Written beside the target and renamed over it, so a batch run never
+  // reads a half-written cache.
+  string target = cache_name(filename);
+  random_device seed;
+  string temporary = target + "." + to_string(seed()) + ".tmp";
+  ofstream out(temporary, ios::binary);
+  if (!out) error("compile: could not open ",temporary);
+  out.write(cache_magic.data(), cache_magic.size());
+  write_raw(out, cache_version);
+  write_raw(out, hash_text(text));
+  write_raw<unsigned int>(out, statements.size());
+  for (const Statement& s : statements) {
+    write_raw<unsigned char>(out, s.kind);
+    write_string(out, s.name);
+    write_code(out, s.code);
+  }
+  out.close();
+  error_code ec;
+  if (!out) ec = make_error_code(errc::io_error);
+  else filesystem::rename(temporary, target, ec);
+  if (ec) {
+    filesystem::remove(temporary, ec);
+    error("compile: could not write ",target);
+  }
+  cout << "Compiled " << statements.size() << " statements to " << target << endl;
+}
+
+// Batch scripts run as three stages joined by bounded single-producer,
+// single-consumer rings: a reader thread streams the script in, the
+// interpreter lexes, parses and evaluates it, and a writer thread drains
+// the formatted output. Lexing stays with evaluation because commands such
+// as 'load env' and 'set precision' read raw input themselves.
+template<class T, size_t N>
+class Spsc_ring
+{
+  private:
+    T slots[N];
+    atomic<size_t> head;
+    atomic<size_t> tail;
+
+    static void wait(unsigned& spins)
+    {
+      if (++spins < 64) this_thread::yield();
+      else this_thread::sleep_for(chrono::microseconds(100));
+    }
+  public:
+    Spsc_ring() : slots(), head(0), tail(0) {}
+
+    void push(T v)
+    {
+      size_t t = tail.load(memory_order_relaxed);
+      for (unsigned spins = 0; t - head.load(memory_order_acquire) == N;) wait(spins);
+      slots[t % N] = move(v);
+      tail.store(t + 1, memory_order_release);
+    }
+
+    T pop()
+    {
+      size_t h = head.load(memory_order_relaxed);
+      for (unsigned spins = 0; tail.load(memory_order_acquire) == h;) wait(spins);
+      T v = move(slots[h % N]);
+      head.store(h + 1, memory_order_release);
+      return v;
+    }
+};
+
+const size_t stage_chunk = 1 << 16;
+
+class Input_stage : public streambuf
+{
+  private:
+    Spsc_ring<string,8> ring;
+    string current;
+    bool finished;
+    atomic<bool> cancelled;
+    thread reader;
+
+  protected:
+    int_type underflow() override
+    {
+      if (finished) return traits_type::eof();
+      current = ring.pop();
+      if (current.empty()) { finished = true; return traits_type::eof(); }
+      setg(&current[0], &current[0], &current[0] + current.size());
+      return traits_type::to_int_type(current[0]);
+    }
+
+  public:
+    Input_stage(const string& filename) : ring(), current(), finished(false), cancelled(false), reader()
+    {
+      auto in = make_shared<ifstream>(filename, ios::binary);
+      if (!*in) error("Could not open ",filename);
+      reader = thread([this, in] {
+        while (!cancelled) {
+          string chunk(stage_chunk, '\0');
+          in->read(&chunk[0], chunk.size());
+          chunk.resize(in->gcount());
+          if (chunk.empty()) break;
+          ring.push(move(chunk));
+        }
+        ring.push(string());
+      });
+    }
+
+    ~Input_stage()
+    {
+      cancelled = true;
+      while (!finished) finished = ring.pop().empty();
+      reader.join();
+    }
+};
+
+class Output_stage : public streambuf
+{
+  private:
+    Spsc_ring<string,8> ring;
+    string buffer;
+    streambuf* console;
+    thread writer;
+
+    void hand_off()
+    {
+      buffer.resize(pptr() - pbase());
+      if (!buffer.empty()) ring.push(move(buffer));
+      buffer.assign(stage_chunk, '\0');
+      setp(&buffer[0], &buffer[0] + buffer.size());
+    }
+
+  protected:
+    int_type overflow(int_type c) override
+    {
+      hand_off();
+      if (!traits_type::eq_int_type(c, traits_type::eof())) sputc(traits_type::to_char_type(c));
+      return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+      hand_off();
+      return 0;
+    }
+
+  public:
+    Output_stage() : ring(), buffer(stage_chunk, '\0'), console(cout.rdbuf(this)), writer()
+    {
+      setp(&buffer[0], &buffer[0] + buffer.size());
+      writer = thread([this] {
+        for (string chunk; !(chunk = ring.pop()).empty();)
+          console->sputn(chunk.data(), chunk.size());
+        console->pubsync();
+      });
+    }
+
+    ~Output_stage()
+    {
+      hand_off();
+      ring.push(string());
+      writer.join();
+      cout.rdbuf(console);
+    }
+};
+
+void run_script(string filename)
+{
+  ios::sync_with_stdio(false);
+  cin.tie(nullptr);
+  interactive = false;
+  Output_stage output;
+
+  if (ifstream(cache_name(filename))) {
+    string text = read_file(filename);
+    vector<Statement> cached;
+    bool loaded = false;
+    try { loaded = load_cache(cache_name(filename), hash_text(text), cached); }
+    catch (exception&) { cached.clear(); }
+    if (loaded) {
+      run_block(cached);
+      return;
+    }
+    istringstream script(text);
+    streambuf* console = cin.rdbuf(script.rdbuf());
+    calculate();
+    cin.rdbuf(console);
+    return;
+  }
+
+  Input_stage input(filename);
+  streambuf* console = cin.rdbuf(&input);
+  calculate();
+  cin.rdbuf(console);
+}
+
+const string record_magic = "CALCR";
+const unsigned int record_version = 1;
+const size_t record_header = 2 * sizeof(unsigned long long) + sizeof(unsigned int);
+
+unsigned long long wall_clock_ns()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class Recording_buf : public streambuf
+{
+  private:
+    streambuf* source;
+    ofstream log;
+    unsigned long long session;
+    char buffer[4096];
+
+  protected:
+    int_type underflow() override
+    {
+      size_t n = 0;
+      for (int c; n < sizeof buffer && (c = source->sbumpc()) != EOF;) {
+        buffer[n++] = char(c);
+        if (c == '\n') break;
+      }
+      if (n == 0) return traits_type::eof();
+
+      write_raw(log, session);
+      write_raw(log, wall_clock_ns());
+      write_raw<unsigned int>(log, n);
+      log.write(buffer, n);
+      log.flush();
+      setg(buffer, buffer, buffer + n);
+      return traits_type::to_int_type(buffer[0]);
+    }
+
+  public:
+    Recording_buf(streambuf* s, const string& filename)
+    : source(s), log(filename, ios::binary | ios::app), session(0)
+    {
+      if (!log) error("record: Could not open ",filename);
+      log.seekp(0, ios::end);
+      if (log.tellp() == 0) {
+        log.write(record_magic.data(), record_magic.size());
+        write_raw(log, record_version);
+      }
+      random_device seed;
+      session = (static_cast<unsigned long long>(seed()) << 32) ^ seed() ^ wall_clock_ns();
+    }
+};
+
+// A log can interleave several sessions; one replay plays back exactly one
+// of them, so that their variables never mix.
+class Replay_buf : public streambuf
+{
+  private:
+    string data;
+    Reader in;
+    bool paced;
+    unsigned long long session;
+    unsigned long long first_ns;
+    chrono::steady_clock::time_point start;
+
+  protected:
+    int_type underflow() override
+    {
+      unsigned long long id, ns;
+      unsigned int n;
+      do {
+        if (data.size() - in.pos < record_header) return traits_type::eof();
+        id = in.get<unsigned long long>();
+        ns = in.get<unsigned long long>();
+        n = in.get<unsigned int>();
+        if (data.size() - in.pos < n) return traits_type::eof();
+        if (id != session) in.pos += n;
+      } while (id != session || n == 0);
+
+      if (first_ns == 0) first_ns = ns;
+      if (paced && ns > first_ns) this_thread::sleep_until(start + chrono::nanoseconds(ns - first_ns));
+      char* p = &data[in.pos];
+      in.pos += n;
+      ++records;
+      recorded_ns = ns - first_ns;
+      setg(p, p, p + n);
+      return traits_type::to_int_type(*p);
+    }
+
+  public:
+    unsigned long records;
+    unsigned long long recorded_ns;
+
+    Replay_buf(const string& filename, bool pace, const string& chosen)
+    : data(read_file(filename)), in(data), paced(pace), session(0), first_ns(0),
+      start(chrono::steady_clock::now()), records(0), recorded_ns(0)
+    {
+      if (data.compare(0, record_magic.size(), record_magic) != 0) error("replay: not a session recording");
+      in.pos = record_magic.size();
+      if (in.get<unsigned int>() != record_version) error("replay: unsupported recording version");
+
+      vector<pair<unsigned long long,unsigned long>> sessions;
+      Reader scan(data);
+      scan.pos = in.pos;
+      while (data.size() - scan.pos >= record_header) {
+        auto id = scan.get<unsigned long long>();
+        scan.get<unsigned long long>();
+        unsigned int n = scan.get<unsigned int>();
+        if (data.size() - scan.pos < n) break;
+        scan.pos += n;
+        auto p = find_if(sessions.begin(), sessions.end(), [&](const auto& s) { return s.first == id; });
+        if (p == sessions.end()) sessions.emplace_back(id, 1);
+        else ++p->second;
+      }
+      if (sessions.empty()) error("replay: ",filename + " holds no input");
+
+      if (!chosen.empty()) {
+        size_t used = 0;
+        try { session = stoull(chosen, &used, 16); }
+        catch (logic_error&) { used = 0; }
+        if (used != chosen.size()) error("replay: bad session id ",chosen);
+        auto p = find_if(sessions.begin(), sessions.end(), [&](const auto& s) { return s.first == session; });
+        if (p == sessions.end()) error("replay: no session ",chosen + " in " + filename);
+      }
+      else if (sessions.size() == 1) session = sessions[0].first;
+      else {
+        ostringstream list;
+        list << "replay: " << filename << " holds " << sessions.size()
+             << " sessions; give the one to replay after the file name:" << hex;
+        for (const auto& s : sessions) list << "\n  " << s.first << " (" << dec << s.second << " lines)" << hex;
+        error(list.str());
+      }
+    }
+};
+
+void replay(const string& filename, bool paced, const string& session)
+{
+  ios::sync_with_stdio(false);
+  cin.tie(nullptr);
+  interactive = false;
+
+  Replay_buf log(filename, paced, session);
+  auto start = chrono::steady_clock::now();
+  streambuf* console = cin.rdbuf(&log);
+  calculate();
+  cin.rdbuf(console);
+  auto stop = chrono::steady_clock::now();
+  cout.flush();
+  cerr << "Replayed " << log.records << " records in "
+       << chrono::duration<double,milli>(stop - start).count() << " ms (recorded over "
+       << log.recorded_ns / 1e6 << " ms)" << endl;
+}
+
+const size_t default_queue_limit = 64;
+atomic<unsigned long long> session_serial{0};
+
+struct calc_session
+{
+  map<string,Value> names;
+  unsigned long long serial;    // names the session in each thread's last errors
+  unsigned weight;
+  size_t queue_limit;
+  unsigned long next_ticket;   // calls of one session are admitted in arrival order
+  unsigned long now_serving;
+  double pass;                 // virtual time at which the session is next admitted
+  Queue_counters queue;
+
+  calc_session() : names(), serial(++session_serial), weight(1), queue_limit(default_queue_limit),
+                   next_ticket(0), now_serving(0), pass(0), queue() {}
+};
+
+struct calc_expr
+{
+  calc_session* session;
+  Code code;
+  vector<string> inputs;
+};
+
+class Session_scope
+{
+  private:
+    calc_session* session;
+  public:
+    Session_scope(calc_session* s) : session(s) { names.swap(session->names); }
+    ~Session_scope() { names.swap(session->names); }
+};
+
+Statement compile_text(const string& text)
+{
+  // The lexer reads the text directly, so the host's std::cin and
+  // std::cout are never touched.
+  stringbuf source(text + ";", ios::in);
+  ts.reset();
+  ts.attach(&source);
+  try {
+    Statement s = compile();
+    Token t = ts.get();
+    if (t.kind!=Token::id::print || ts.get().kind!=Token::id::quit) error("unexpected text after statement");
+    ts.attach(nullptr);
+    ts.reset();
+    return s;
+  }
+  catch (...) {
+    ts.attach(nullptr);
+    ts.reset();
+    throw;
+  }
+}
+
+// Calls queue per session and run one at a time. Whenever the calculator
+// is free, the waiting session with the lowest pass goes next and its pass
+// advances by 1/weight, so busy sessions get calls in proportion to their
+// weights. A session that was idle rejoins at the current virtual time
+// instead of with credit saved up.
+condition_variable schedule_turn;
+bool calculator_busy = false;
+double virtual_time = 0;
+list<calc_session*> backlogged;   // sessions with waiting calls
+
+calc_session* next_session()
+{
+  calc_session* next = nullptr;
+  for (calc_session* s : backlogged)
+    if (!next || s->pass < next->pass) next = s;
+  return next;
+}
+
+class Admission_scope
+{
+  public:
+    Admission_scope(calc_session* s)
+    {
+      unique_lock<mutex> lock(schedule_lock);
+      if (s->next_ticket - s->now_serving >= s->queue_limit) {
+        ++s->queue.rejected;
+        ++queue_totals.rejected;
+        error("queue full: ", to_string(s->queue_limit) + " calls already waiting on this session");
+      }
+      auto start = chrono::steady_clock::now();
+      unsigned long ticket = s->next_ticket++;
+      if (ticket == s->now_serving) {
+        s->pass = max(s->pass, virtual_time);
+        backlogged.push_back(s);
+      }
+      schedule_turn.wait(lock, [&] { return !calculator_busy && s->now_serving == ticket && next_session() == s; });
+      calculator_busy = true;
+      virtual_time = s->pass;
+      s->pass += 1.0 / s->weight;
+      if (++s->now_serving == s->next_ticket) backlogged.remove(s);
+      double wait = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      s->queue.add(wait);
+      queue_totals.add(wait);
+    }
+    ~Admission_scope()
+    {
+      { lock_guard<mutex> lock(schedule_lock); calculator_busy = false; }
+      schedule_turn.notify_all();
+    }
+};
+
+// Each thread keeps its own last error per session, so a failure on one
+// thread never changes the string another thread got from calc_last_error.
+thread_local unordered_map<unsigned long long,string> last_errors;
+
+void report(const calc_session* session, const string& message)
+{ last_errors[session->serial] = message; }
+
+template<class F> int guarded(calc_session* session, F f)
+{
+  try {
+    Admission_scope admitted(session);
+    f();
+    return 0;
+  }
+  catch (exception& e) { report(session, e.what()); }
+  catch (...) { report(session, "unknown error"); }
+  return -1;
+}
+
+extern "C" calc_session* calc_session_new(void)
+{
+  try { return new calc_session; }
+  catch (...) { return nullptr; }
+}
+
+extern "C" void calc_session_free(calc_session* session)
+{
+  last_errors.erase(session->serial);
+  delete session;
+}
+
+extern "C" const char* calc_last_error(const calc_session* session)
+{
+  auto p = last_errors.find(session->serial);
+  return p == last_errors.end() ? "" : p->second.c_str();
+}
+
+extern "C" int calc_set_weight(calc_session* session, unsigned weight)
+{
+  if (weight == 0) { report(session, "calc_set_weight: weight must be at least 1"); return -1; }
+  lock_guard<mutex> lock(schedule_lock);
+  session->weight = weight;
+  return 0;
+}
+
+extern "C" int calc_set_queue_limit(calc_session* session, size_t limit)
+{
+  if (limit == 0) { report(session, "calc_set_queue_limit: limit must be at least 1"); return -1; }
+  lock_guard<mutex> lock(schedule_lock);
+  session->queue_limit = limit;
+  return 0;
+}
+
+extern "C" void calc_get_queue_stats(const calc_session* session, calc_queue_stats* stats)
+{
+  lock_guard<mutex> lock(schedule_lock);
+  stats->admitted = session->queue.admitted;
+  stats->rejected = session->queue.rejected;
+  stats->wait_seconds = session->queue.wait;
+  stats->max_wait_seconds = session->queue.max_wait;
+  stats->waiting = session->next_ticket - session->now_serving;
+}
+
+extern "C" int calc_set(calc_session* session, const char* name, double value)
+{
+  return guarded(session, [&] {
+    Session_scope scope(session);
+    if (is_constant(name)) error(name," constant cannot be modified");
+    define_name(name, value);
+  });
+}
+
+extern "C" int calc_run(calc_session* session, const char* statement, double* result)
+{
+  return guarded(session, [&] {
+    Session_scope scope(session);
+    double d = execute(compile_text(statement));
+    if (result) *result = d;
+  });
+}
+
+extern "C" calc_expr* calc_compile(calc_session* session, const char* expression)
+{
+  calc_expr* expr = nullptr;
+  guarded(session, [&] {
+    Session_scope scope(session);
+    Statement s = compile_text(expression);
+    if (s.kind!=Statement::id::expression) error("calc_compile: expected an expression");
+
+    auto e = make_unique<calc_expr>();
+    e->session = session;
+    e->code = s.code;
+    for (Instruction& in : e->code) {
+      if (in.kind!=Instruction::id::load || is_declared(in.name)) continue;
+      auto p = find(e->inputs.begin(), e->inputs.end(), in.name);
+      in.kind = Instruction::id::load_column;
+      in.column = p - e->inputs.begin();
+      if (p == e->inputs.end()) e->inputs.push_back(in.name);
+    }
+    expr = e.release();
+  });
+  return expr;
+}
+
+extern "C" void calc_expr_free(calc_expr* expr)
+{ delete expr; }
+
+extern "C" size_t calc_expr_inputs(const calc_expr* expr)
+{ return expr->inputs.size(); }
+
+extern "C" const char* calc_expr_input_name(const calc_expr* expr, size_t i)
+{ return i < expr->inputs.size() ? expr->inputs[i].c_str() : nullptr; }
+
+extern "C" int calc_eval_batch(calc_expr* expr, size_t n, const double** input_columns, double* out)
+{
+  return guarded(expr->session, [&] {
+    Session_scope scope(expr->session);
+    Code code = expr->code;
+    for (Instruction& in : code)
+      if (in.kind==Instruction::id::load) in = Instruction(get_value(in.name));
+    vector<const double*> columns(input_columns, input_columns + expr->inputs.size());
+    run_columns(code, columns, n, out);
+  });
+}
+
+#ifndef CALC_LIBRARY
+
+int main(int argc, char* argv[])
 try 
 {
+  string script;
+  string image;
+  string record;
+  string playback;
+  string session;
+  bool paced = true;
+  bool compile_only = false;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "-O") optimize = true;
+    else if (arg == "-c") compile_only = true;
+    else if (arg == "-i" && i + 1 < argc) image = argv[++i];
+    else if (arg == "-r" && i + 1 < argc) record = argv[++i];
+    else if (arg == "-T") pin_threads = true;
+    else if (arg == "-N") native = true;
+    else if (arg == "-W" && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1) { cerr << "-W: expected a number of worker processes" << endl; return 1; }
+      worker_processes = n;
+    }
+    else if ((arg == "-p" || arg == "-P") && i + 1 < argc) {
+      playback = argv[++i];
+      paced = (arg == "-p");
+      if (i + 1 < argc && argv[i+1][0] && strspn(argv[i+1], "0123456789abcdefABCDEF") == strlen(argv[i+1])) session = argv[++i];
+    }
+    else script = arg;
+  }
+
+  if (!record.empty() && (!script.empty() || !playback.empty())) {
+    cerr << "-r records standard input; it cannot be combined with a script or a replay" << endl;
+    return 1;
+  }
+
+  if (!image.empty()) {
+    try { load_image(image); }
+    catch (runtime_error& e) { cerr << e.what() << endl; return 1; }
+  }
+
+  if (!script.empty()) {
+    try {
+      if (compile_only) compile_script(script);
+      else run_script(script);
+    }
+    catch (runtime_error& e) { cerr << e.what() << endl; return 1; }
+    return 0;
+  }
+  if (!playback.empty()) {
+    try { replay(playback, paced, session); }
+    catch (runtime_error& e) { cerr << e.what() << endl; return 1; }
+    return 0;
+  }
+  static unique_ptr<Recording_buf> recorder;
+  streambuf* console = cin.rdbuf();
+  if (!record.empty()) {
+    try { recorder = make_unique<Recording_buf>(console, record); }
+    catch (runtime_error& e) { cerr << e.what() << endl; return 1; }
+    cin.rdbuf(recorder.get());
+  }
   help();
   calculate();
+  cin.rdbuf(console);
   return 0;
 }
 catch (exception& e) {
@@ -801,3 +4222,5 @@ catch (...) {
   while((cin>>c) && (c!=';')) ;
   return 2;
 }
+
+#endif